@@ -0,0 +1,72 @@
+/*
+ * farm-lib.c
+ *
+ * Socket helpers for the mandel render farm.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "farm-lib.h"
+
+static int fill_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/* Listen on path, replacing a stale socket left behind there */
+int farm_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (fill_addr(&addr, path) < 0)
+		return -1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 64) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Connect to the coordinator at path. Workers may be started before
+ * the coordinator is listening, so keep trying for up to retry_ms.
+ */
+int farm_connect(const char *path, int retry_ms)
+{
+	struct sockaddr_un addr;
+	struct timespec ts = { 0, 10000000 };
+	int fd;
+
+	if (fill_addr(&addr, path) < 0)
+		return -1;
+	for (;;) {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+			return -1;
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+			return fd;
+		close(fd);
+		if ((errno != ENOENT && errno != ECONNREFUSED) || retry_ms <= 0)
+			return -1;
+		nanosleep(&ts, NULL);
+		retry_ms -= 10;
+	}
+}
@@ -0,0 +1,44 @@
+/*
+ * farm-lib.h
+ *
+ * Wire format and socket helpers for the mandel render farm: a
+ * coordinator hands out tiles over Unix domain sockets and any
+ * number of worker processes send the color values back.
+ *
+ */
+
+#ifndef FARM_LIB_H__
+#define FARM_LIB_H__
+
+/*
+ * Coordinator to worker, once per connection. All messages are in
+ * host byte order: coordinator and workers run on the same machine.
+ */
+struct farm_setup {
+	double xmin, ymax;	/* Upper left corner of the viewport */
+	double xmin_lo, ymax_lo;	/* ... in double-double */
+	double xstep, ystep;	/* Size of one output character */
+	int dd;			/* Render in double-double */
+	int kernel;		/* Index in fractal_kernels[] */
+	double cr, ci;		/* c of a Julia set */
+};
+
+/* Coordinator to worker: render this rectangle */
+struct farm_tile {
+	int id;
+	int row0, nrows;
+	int col0, ncols;
+	int max_iter;
+};
+
+/* Worker to coordinator, followed by nrows * ncols color values */
+struct farm_result {
+	int id;
+	int nrows, ncols;
+};
+
+/* Function prototypes */
+int farm_listen(const char *path);
+int farm_connect(const char *path, int retry_ms);
+
+#endif /* FARM_LIB_H__ */
@@ -0,0 +1,454 @@
+/*
+ * fractal-lib.c
+ *
+ * The escape time kernels of fractal-lib.h, generated by macros.
+ *
+ * Built with -ffp-contract=off: a multiply and add fused by the
+ * compiler would break the exact products of double-double, and
+ * could make the scalar and SIMD counts differ.
+ *
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+# define HAVE_AVX2 1
+#endif
+
+#include "fractal-lib.h"
+
+/*
+ * GCC vector extensions: the same source becomes SSE2, AVX2 or NEON
+ * code. Comparisons give -1 in the lanes where they hold, 0 elsewhere.
+ * The 4 lane vectors are only used in functions built for AVX2;
+ * anywhere else GCC would split them into slow scalar code.
+ */
+typedef double vdouble2 __attribute__((vector_size(16)));
+typedef long long vlong2 __attribute__((vector_size(16)));
+typedef double vdouble4 __attribute__((vector_size(32)));
+typedef long long vlong4 __attribute__((vector_size(32)));
+
+/* a where mask m is set, b elsewhere */
+#define BLEND(LANES, m, a, b) \
+	((vdouble##LANES)(((vlong##LANES)(a) & m) | ((vlong##LANES)(b) & ~m)))
+
+/*
+ * One step z = z^d + c, per exponent. Each works on scalars and on
+ * vectors alike; the multiplications are spelled out so that d is
+ * fixed at compile time.
+ */
+#define POW_STEP_2(zr, zi, cr, ci, nr, ni) do {				\
+	nr = zr * zr - zi * zi + cr;					\
+	ni = 2 * zr * zi + ci;						\
+} while (0)
+
+#define POW_STEP_3(zr, zi, cr, ci, nr, ni) do {				\
+	nr = zr * zr * zr - 3 * zr * zi * zi + cr;			\
+	ni = 3 * zr * zr * zi - zi * zi * zi + ci;			\
+} while (0)
+
+#define POW_STEP_4(zr, zi, cr, ci, nr, ni) do {				\
+	__typeof__(zr) sr = zr * zr - zi * zi, si = 2 * zr * zi;	\
+	nr = sr * sr - si * si + cr;					\
+	ni = 2 * sr * si + ci;						\
+} while (0)
+
+/*
+ * The scalar kernel counts the steps until |z| > 2, at most max, just
+ * like mandel_iterations_at_point().
+ */
+#define DEFINE_SCALAR(name, JULIA, POW)					\
+static int name##_scalar(double x, double y, double jr, double ji, int max) \
+{									\
+	double zr = x, zi = y, nr, ni;					\
+	double cr = JULIA ? jr : x, ci = JULIA ? ji : y;		\
+	int iter = 0;							\
+									\
+	while (zr * zr + zi * zi <= 4 && iter < max) {			\
+		POW_STEP_##POW(zr, zi, cr, ci, nr, ni);			\
+		zr = nr;						\
+		zi = ni;						\
+		++iter;							\
+	}								\
+	return iter;							\
+}
+
+/*
+ * The SIMD kernels run the same steps on LANES points at once: a lane
+ * that has escaped keeps its z and stops counting, so they give the
+ * same counts as the scalar one. The lanes are only checked every
+ * FRACTAL_CHECK steps; the steps of escaped lanes in between are
+ * wasted, but counted nowhere.
+ */
+#define FRACTAL_CHECK	8
+
+#define DEFINE_BATCH(name, ATTR, LANES, JULIA, POW)			\
+ATTR static void name(const double *x, const double *y, int n,		\
+	double jr, double ji, int max, int *iters)			\
+{									\
+	double p[4][LANES];						\
+	vdouble##LANES zr, zi, cr, ci, nr, ni;				\
+	vlong##LANES it, in, any;					\
+	int i, j, l, k;							\
+									\
+	for (i = 0; i < n; i += LANES) {				\
+		/* Pad a short last batch with copies of its first point */ \
+		for (l = 0; l < LANES; l++) {				\
+			p[0][l] = x[i + l < n ? i + l : i];		\
+			p[1][l] = y[i + l < n ? i + l : i];		\
+			p[2][l] = JULIA ? jr : p[0][l];			\
+			p[3][l] = JULIA ? ji : p[1][l];			\
+		}							\
+		memcpy(&zr, p[0], sizeof(zr));				\
+		memcpy(&zi, p[1], sizeof(zi));				\
+		memcpy(&cr, p[2], sizeof(cr));				\
+		memcpy(&ci, p[3], sizeof(ci));				\
+		memset(&it, 0, sizeof(it));				\
+		for (k = 0; k < max; k += FRACTAL_CHECK) {		\
+			any = it;					\
+			for (j = 0; j < FRACTAL_CHECK && k + j < max; j++) { \
+				in = zr * zr + zi * zi <= 4;		\
+				POW_STEP_##POW(zr, zi, cr, ci, nr, ni);	\
+				zr = BLEND(LANES, in, nr, zr);		\
+				zi = BLEND(LANES, in, ni, zi);		\
+				it -= in;				\
+			}						\
+			any = (it - any) == FRACTAL_CHECK;		\
+			for (l = 1; l < LANES; l++)			\
+				any[0] |= any[l];			\
+			if (!any[0])					\
+				break;					\
+		}							\
+		for (l = 0; l < LANES && i + l < n; l++)		\
+			iters[i + l] = it[l];				\
+	}								\
+}
+
+#define AVX2_ATTR	__attribute__((target("avx2,fma")))
+
+#ifdef HAVE_AVX2
+# define DEFINE_BATCH_AVX2(name, JULIA, POW) \
+	DEFINE_BATCH(name##_avx2, AVX2_ATTR, 4, JULIA, POW)
+# define AVX2_FN(name)	name##_avx2
+#else
+# define DEFINE_BATCH_AVX2(name, JULIA, POW)
+# define AVX2_FN(name)	NULL
+#endif
+
+#define DEFINE_KERNEL(name, JULIA, POW)					\
+	DEFINE_SCALAR(name, JULIA, POW)					\
+	DEFINE_BATCH(name##_vec2, , 2, JULIA, POW)			\
+	DEFINE_BATCH_AVX2(name, JULIA, POW)
+
+/*
+ * Double-double arithmetic, for scalars and vectors alike. TWO_SUM and
+ * TWO_PROD give the rounded result and its exact error; TWO_PROD
+ * splits its operands in halves (Dekker), unless the FMA instruction
+ * can give the error directly.
+ */
+#define DD_TWO_SUM(a, b, s, e) do {					\
+	__typeof__(s) bb_;						\
+	s = a + b;							\
+	bb_ = s - a;							\
+	e = (a - (s - bb_)) + (b - bb_);				\
+} while (0)
+
+/* The same, only for |a| >= |b| */
+#define DD_QUICK_TWO_SUM(a, b, s, e) do {				\
+	s = a + b;							\
+	e = b - (s - a);						\
+} while (0)
+
+#define DD_SPLIT(a, hi, lo) do {					\
+	__typeof__(hi) t_ = 134217729.0 * a;	/* 2^27 + 1 */		\
+	hi = t_ - (t_ - a);						\
+	lo = a - hi;							\
+} while (0)
+
+#define DD_TWO_PROD(a, b, p, e) do {					\
+	__typeof__(p) ah_, al_, bh_, bl_;				\
+	p = a * b;							\
+	DD_SPLIT(a, ah_, al_);						\
+	DD_SPLIT(b, bh_, bl_);						\
+	e = ((ah_ * bh_ - p) + ah_ * bl_ + al_ * bh_) + al_ * bl_;	\
+} while (0)
+
+#define DD_TWO_PROD_FMA(a, b, p, e) do {				\
+	p = a * b;							\
+	e = (vdouble4)_mm256_fmsub_pd((__m256d)a, (__m256d)b, (__m256d)p); \
+} while (0)
+
+/*
+ * One step z = z^2 + c in double-double. The products drop the lo * lo
+ * terms, and the sums skip renormalizing in between, which keeps
+ * about 104 bits: far more than any zoom a terminal can show needs.
+ */
+#define DD_STEP(TWO_PROD, rh, rl, ih, il, crh, crl, cih, cil, nrh, nrl, nih, nil) do { \
+	__typeof__(rh) x2h, x2l, y2h, y2l, xyh, xyl, th, tl, e_;	\
+									\
+	TWO_PROD(rh, rh, x2h, x2l);					\
+	x2l += 2 * rh * rl;						\
+	TWO_PROD(ih, ih, y2h, y2l);					\
+	y2l += 2 * ih * il;						\
+	TWO_PROD(rh, ih, xyh, xyl);					\
+	xyl += rh * il + rl * ih;					\
+									\
+	/* zr = x^2 - y^2 + cr */					\
+	DD_TWO_SUM(x2h, -y2h, th, e_);					\
+	e_ += x2l - y2l;						\
+	DD_QUICK_TWO_SUM(th, e_, x2h, tl);				\
+	DD_TWO_SUM(x2h, crh, th, e_);					\
+	e_ += tl + crl;							\
+	DD_QUICK_TWO_SUM(th, e_, nrh, nrl);				\
+									\
+	/* zi = 2xy + ci */						\
+	DD_TWO_SUM(2 * xyh, cih, th, e_);				\
+	e_ += 2 * xyl + cil;						\
+	DD_QUICK_TWO_SUM(th, e_, nih, nil);				\
+} while (0)
+
+/*
+ * The double-double kernels of z^2 + c, scalar and SIMD. The escape
+ * test only needs the hi parts. The SIMD versions work like the
+ * double ones above.
+ */
+#define DEFINE_DD_SCALAR(name, JULIA)					\
+static int name##_dd_scalar(double xh, double xl, double yh, double yl,	\
+	double jr, double ji, int max)					\
+{									\
+	double rh = xh, rl = xl, ih = yh, il = yl, nrh, nrl, nih, nil;	\
+	double crh = JULIA ? jr : xh, crl = JULIA ? 0 : xl;		\
+	double cih = JULIA ? ji : yh, cil = JULIA ? 0 : yl;		\
+	int iter = 0;							\
+									\
+	while (rh * rh + ih * ih <= 4 && iter < max) {			\
+		DD_STEP(DD_TWO_PROD, rh, rl, ih, il, crh, crl, cih, cil, \
+			nrh, nrl, nih, nil);				\
+		rh = nrh;						\
+		rl = nrl;						\
+		ih = nih;						\
+		il = nil;						\
+		++iter;							\
+	}								\
+	return iter;							\
+}
+
+#define DEFINE_DD_BATCH(name, ATTR, LANES, JULIA, TWO_PROD)		\
+ATTR static void name(const double *xh, const double *xl,		\
+	const double *yh, const double *yl, int n, double jr, double ji, \
+	int max, int *iters)						\
+{									\
+	double p[8][LANES];						\
+	vdouble##LANES rh, rl, ih, il, crh, crl, cih, cil;		\
+	vdouble##LANES nrh, nrl, nih, nil;				\
+	vlong##LANES it, in, any;					\
+	int i, j, l, k, m;						\
+									\
+	for (i = 0; i < n; i += LANES) {				\
+		/* Pad a short last batch with copies of its first point */ \
+		for (l = 0; l < LANES; l++) {				\
+			m = i + l < n ? i + l : i;			\
+			p[0][l] = xh[m];				\
+			p[1][l] = xl[m];				\
+			p[2][l] = yh[m];				\
+			p[3][l] = yl[m];				\
+			p[4][l] = JULIA ? jr : xh[m];			\
+			p[5][l] = JULIA ? 0 : xl[m];			\
+			p[6][l] = JULIA ? ji : yh[m];			\
+			p[7][l] = JULIA ? 0 : yl[m];			\
+		}							\
+		memcpy(&rh, p[0], sizeof(rh));				\
+		memcpy(&rl, p[1], sizeof(rl));				\
+		memcpy(&ih, p[2], sizeof(ih));				\
+		memcpy(&il, p[3], sizeof(il));				\
+		memcpy(&crh, p[4], sizeof(crh));			\
+		memcpy(&crl, p[5], sizeof(crl));			\
+		memcpy(&cih, p[6], sizeof(cih));			\
+		memcpy(&cil, p[7], sizeof(cil));			\
+		memset(&it, 0, sizeof(it));				\
+		for (k = 0; k < max; k += FRACTAL_CHECK) {		\
+			any = it;					\
+			for (j = 0; j < FRACTAL_CHECK && k + j < max; j++) { \
+				in = rh * rh + ih * ih <= 4;		\
+				DD_STEP(TWO_PROD, rh, rl, ih, il, crh, crl, cih, cil, \
+					nrh, nrl, nih, nil);		\
+				rh = BLEND(LANES, in, nrh, rh);		\
+				rl = BLEND(LANES, in, nrl, rl);		\
+				ih = BLEND(LANES, in, nih, ih);		\
+				il = BLEND(LANES, in, nil, il);		\
+				it -= in;				\
+			}						\
+			any = (it - any) == FRACTAL_CHECK;		\
+			for (l = 1; l < LANES; l++)			\
+				any[0] |= any[l];			\
+			if (!any[0])					\
+				break;					\
+		}							\
+		for (l = 0; l < LANES && i + l < n; l++)		\
+			iters[i + l] = it[l];				\
+	}								\
+}
+
+#ifdef HAVE_AVX2
+# define DEFINE_DD_BATCH_AVX2(name, JULIA) \
+	DEFINE_DD_BATCH(name##_dd_avx2, AVX2_ATTR, 4, JULIA, DD_TWO_PROD_FMA)
+#else
+# define DEFINE_DD_BATCH_AVX2(name, JULIA)
+#endif
+
+#define DEFINE_DD_KERNEL(name, JULIA)					\
+	DEFINE_DD_SCALAR(name, JULIA)					\
+	DEFINE_DD_BATCH(name##_dd_vec2, , 2, JULIA, DD_TWO_PROD)	\
+	DEFINE_DD_BATCH_AVX2(name, JULIA)
+
+DEFINE_KERNEL(mandel2, 0, 2)
+DEFINE_KERNEL(mandel3, 0, 3)
+DEFINE_KERNEL(mandel4, 0, 4)
+DEFINE_KERNEL(julia2, 1, 2)
+DEFINE_KERNEL(julia3, 1, 3)
+DEFINE_KERNEL(julia4, 1, 4)
+DEFINE_DD_KERNEL(mandel2, 0)
+DEFINE_DD_KERNEL(julia2, 1)
+
+#define KERNEL_ENTRY(label, name, JULIA, POW) \
+	{ label, JULIA, POW, name##_scalar, { name##_vec2, AVX2_FN(name) }, NULL, \
+	  NULL, { NULL, NULL }, NULL }
+
+#define KERNEL_ENTRY_DD(label, name, JULIA, POW) \
+	{ label, JULIA, POW, name##_scalar, { name##_vec2, AVX2_FN(name) }, NULL, \
+	  name##_dd_scalar, { name##_dd_vec2, AVX2_FN(name##_dd) }, NULL }
+
+struct fractal_kernel fractal_kernels[] = {
+	KERNEL_ENTRY_DD("mandel", mandel2, 0, 2),
+	KERNEL_ENTRY("mandel3", mandel3, 0, 3),
+	KERNEL_ENTRY("mandel4", mandel4, 0, 4),
+	KERNEL_ENTRY_DD("julia", julia2, 1, 2),
+	KERNEL_ENTRY("julia3", julia3, 1, 3),
+	KERNEL_ENTRY("julia4", julia4, 1, 4),
+};
+
+const int fractal_nkernels = sizeof(fractal_kernels) / sizeof(fractal_kernels[0]);
+
+const char *fractal_simd_names[FRACTAL_NSIMD] = { "vec2", "avx2" };
+
+#ifdef HAVE_AVX2
+static int detect_avx2(void)
+{
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+#else
+static int detect_avx2(void)
+{
+	return 0;
+}
+#endif
+
+/* Whether the SIMD versions for simd are built and this CPU runs them */
+int fractal_simd_supported(enum fractal_simd simd)
+{
+	if (!fractal_kernels[0].simd[simd])
+		return 0;
+	return simd != FRACTAL_AVX2 || detect_avx2();
+}
+
+/*
+ * Look a kernel up by name, NULL if there is none. The first lookup
+ * fills in the batch functions of every kernel; do it before starting
+ * threads.
+ */
+const struct fractal_kernel *fractal_find(const char *name)
+{
+	int i, simd;
+
+	if (!fractal_kernels[0].batch) {
+		simd = fractal_simd_supported(FRACTAL_AVX2) ? FRACTAL_AVX2 : FRACTAL_VEC2;
+		for (i = 0; i < fractal_nkernels; i++) {
+			fractal_kernels[i].batch = fractal_kernels[i].simd[simd];
+			fractal_kernels[i].dd_batch = fractal_kernels[i].dd_simd[simd];
+		}
+	}
+
+	for (i = 0; i < fractal_nkernels; i++)
+		if (strcmp(name, fractal_kernels[i].name) == 0)
+			return &fractal_kernels[i];
+	return NULL;
+}
+
+/* a * b and a / b in double-double, for the parser */
+static struct fractal_dd dd_mul(struct fractal_dd a, double b)
+{
+	struct fractal_dd r;
+	double p, e;
+
+	DD_TWO_PROD(a.hi, b, p, e);
+	e += a.lo * b;
+	DD_QUICK_TWO_SUM(p, e, r.hi, r.lo);
+	return r;
+}
+
+static struct fractal_dd dd_div(struct fractal_dd a, double b)
+{
+	struct fractal_dd r;
+	double q1, q2, p, e, s, f;
+
+	q1 = a.hi / b;
+	DD_TWO_PROD(q1, b, p, e);
+	DD_TWO_SUM(a.hi, -p, s, f);
+	f += a.lo - e;
+	q2 = (s + f) / b;
+	DD_QUICK_TWO_SUM(q1, q2, r.hi, r.lo);
+	return r;
+}
+
+/*
+ * Parse a decimal number like strtod(), but to double-double, so that
+ * all the digits of a deep zoom's center count. Returns the end of the
+ * number, or NULL if there is none.
+ */
+const char *fractal_dd_parse(const char *s, struct fractal_dd *d)
+{
+	struct fractal_dd v = { 0, 0 };
+	int neg = 0, dot = 0, digits = 0, exp10 = 0, i, k;
+	double pow10;
+	char *end;
+
+	if (*s == '-' || *s == '+')
+		neg = *s++ == '-';
+	for (; isdigit((unsigned char)*s) || (*s == '.' && !dot); s++) {
+		if (*s == '.') {
+			dot = 1;
+			continue;
+		}
+		v = fractal_dd_add(dd_mul(v, 10), *s - '0');
+		digits++;
+		exp10 -= dot;
+	}
+	if (!digits)
+		return NULL;
+	if (*s == 'e' || *s == 'E') {
+		exp10 += strtol(s + 1, &end, 10);
+		if (end == s + 1)
+			return NULL;
+		s = end;
+	}
+
+	/* Powers of ten up to 1e22 are exact doubles */
+	while (exp10 != 0 && v.hi != 0) {
+		k = abs(exp10) < 22 ? abs(exp10) : 22;
+		for (pow10 = 1, i = 0; i < k; i++)
+			pow10 *= 10;
+		if (exp10 > 0) {
+			v = dd_mul(v, pow10);
+			exp10 -= k;
+		} else {
+			v = dd_div(v, pow10);
+			exp10 += k;
+		}
+	}
+
+	d->hi = neg ? -v.hi : v.hi;
+	d->lo = neg ? -v.lo : v.lo;
+	return s;
+}
@@ -0,0 +1,78 @@
+/*
+ * fractal-lib.h
+ *
+ * A family of escape time kernels, specialized at compile time per
+ * fractal and exponent: Mandelbrot sets (z0 = c = the point) and Julia
+ * sets (z0 = the point, c fixed) of z^d + c. Every kernel comes as a
+ * scalar version and SIMD versions, and is picked at run time from a
+ * table, so the inner loops carry no branches on the kind of set.
+ * The sets of z^2 + c also come in double-double precision, for zooms
+ * deeper than a double can resolve.
+ *
+ */
+
+#ifndef FRACTAL_LIB_H__
+#define FRACTAL_LIB_H__
+
+/* The SIMD versions, by instruction set */
+enum fractal_simd {
+	FRACTAL_VEC2,		/* 2 lanes, SSE2 or NEON: everywhere */
+	FRACTAL_AVX2,		/* 4 lanes, x86 CPUs with AVX2 and FMA only */
+	FRACTAL_NSIMD
+};
+
+/*
+ * A double-double number: the unevaluated sum hi + lo, with lo at most
+ * half an ulp of hi, good for about 106 bits (32 decimal digits).
+ */
+struct fractal_dd {
+	double hi, lo;
+};
+
+typedef int (*fractal_scalar_fn)(double x, double y, double cr, double ci, int max);
+typedef void (*fractal_batch_fn)(const double *x, const double *y, int n,
+	double cr, double ci, int max, int *iters);
+typedef int (*fractal_dd_scalar_fn)(double xh, double xl, double yh, double yl,
+	double cr, double ci, int max);
+typedef void (*fractal_dd_batch_fn)(const double *xh, const double *xl,
+	const double *yh, const double *yl, int n, double cr, double ci, int max,
+	int *iters);
+
+struct fractal_kernel {
+	const char *name;
+	int julia;		/* c is (cr, ci) instead of the point */
+	int power;
+	fractal_scalar_fn scalar;
+	fractal_batch_fn simd[FRACTAL_NSIMD];	/* NULL if not built */
+	fractal_batch_fn batch;	/* The best of simd[] this CPU runs */
+
+	/* The same in double-double, all NULL if there is none */
+	fractal_dd_scalar_fn dd_scalar;
+	fractal_dd_batch_fn dd_simd[FRACTAL_NSIMD];
+	fractal_dd_batch_fn dd_batch;
+};
+
+extern struct fractal_kernel fractal_kernels[];
+extern const int fractal_nkernels;
+extern const char *fractal_simd_names[FRACTAL_NSIMD];
+
+/* Function prototypes */
+int fractal_simd_supported(enum fractal_simd simd);
+const struct fractal_kernel *fractal_find(const char *name);
+const char *fractal_dd_parse(const char *s, struct fractal_dd *d);
+
+/* a + b in double-double */
+static inline struct fractal_dd fractal_dd_add(struct fractal_dd a, double b)
+{
+	struct fractal_dd r;
+	double s, bb, e;
+
+	s = a.hi + b;
+	bb = s - a.hi;
+	e = (a.hi - (s - bb)) + (b - bb) + a.lo;
+	r.hi = s + e;
+	r.lo = e - (r.hi - s);
+	return r;
+}
+
+#endif /* FRACTAL_LIB_H__ */
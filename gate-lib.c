@@ -0,0 +1,563 @@
+/*
+ * gate-lib.c
+ *
+ * A ratio admission gate: consumers may only be inside while there
+ * are at least 1/ratio providers per consumer. Providers come in
+ * freely, but may only leave if the consumers they leave behind
+ * still fit. This is the kindergarten rule (teachers provide,
+ * children consume), packaged for reuse.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "gate-lib.h"
+
+#define GATE_PROVIDERS(s)	((int)((s) >> 32))
+#define GATE_CONSUMERS(s)	((int)((s) & 0xffffffff))
+#define GATE_ONE_PROVIDER	((uint64_t)1 << 32)
+#define GATE_ONE_CONSUMER	((uint64_t)1)
+
+/*
+ * Parse "barging", "fifo", "teacher" (bounded:0, waiting providers
+ * always go first) or "bounded:K".
+ */
+int gate_parse_policy(const char *s, struct gate_config *cfg)
+{
+	char *endp;
+	long k;
+
+	if (strcmp(s, "barging") == 0)
+		cfg->policy = GATE_BARGING;
+	else if (strcmp(s, "fifo") == 0)
+		cfg->policy = GATE_FIFO;
+	else if (strcmp(s, "teacher") == 0) {
+		cfg->policy = GATE_BOUNDED;
+		cfg->max_bypass = 0;
+	} else if (strncmp(s, "bounded:", 8) == 0) {
+		k = strtol(s + 8, &endp, 10);
+		if (endp == s + 8 || *endp != '\0' || k < 0)
+			return -1;
+		cfg->policy = GATE_BOUNDED;
+		cfg->max_bypass = k;
+	} else
+		return -1;
+	snprintf(cfg->name, sizeof(cfg->name), "%s", s);
+	return 0;
+}
+
+/* The policy as it was given, so that every alias reports itself */
+const char *gate_policy_name(const struct gate_config *cfg)
+{
+	static char buf[32];
+
+	if (cfg->name[0])
+		return cfg->name;
+	switch (cfg->policy) {
+	case GATE_FIFO:
+		return "fifo";
+	case GATE_BOUNDED:
+		snprintf(buf, sizeof(buf), "bounded:%d", cfg->max_bypass);
+		return buf;
+	default:
+		return "barging";
+	}
+}
+
+int gate_init(struct gate *g, const struct gate_config *cfg)
+{
+	int ret;
+
+	memset(g, 0, sizeof(*g));
+	g->cfg = *cfg;
+	ret = pthread_mutex_init(&g->mutex, NULL);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+void gate_destroy(struct gate *g)
+{
+	pthread_mutex_destroy(&g->mutex);
+}
+
+/* Waiter condition variables time out against CLOCK_MONOTONIC */
+int gate_waiter_init(struct gate_waiter *w)
+{
+	pthread_condattr_t attr;
+	int ret;
+
+	memset(w, 0, sizeof(*w));
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	ret = pthread_cond_init(&w->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+void gate_waiter_destroy(struct gate_waiter *w)
+{
+	pthread_cond_destroy(&w->cond);
+}
+
+/* Deadline us microseconds from now, for the blocking calls */
+void gate_deadline(struct timespec *ts, long us)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Mutex mode.
+ *
+ * Blocked threads sit in one queue in arrival order. Whoever makes
+ * room performs the transition on behalf of the waiters that now fit
+ * and signals exactly those, so a woken thread never has to check
+ * again, and a batch of k consumers is admitted all at once or not
+ * at all. All of these must be called with the mutex held.
+ */
+static int consumers_fit(struct gate *g, int k)
+{
+	return g->consumers + k <= g->providers * g->cfg.ratio;
+}
+
+static int provider_may_leave(struct gate *g)
+{
+	return (g->providers - 1) * g->cfg.ratio >= g->consumers;
+}
+
+/* May need more consumers overtake the providers waiting to leave? */
+static int consumers_may_bypass(struct gate *g, int need)
+{
+	return g->cfg.policy != GATE_BOUNDED || g->providers_waiting == 0 ||
+		g->bypassed + need <= g->cfg.max_bypass;
+}
+
+/* Fast path: go without queueing? */
+static int may_go_now(struct gate *g, struct gate_waiter *w)
+{
+	if (g->cfg.policy == GATE_FIFO && g->head)
+		return 0;
+	if (w->is_consumer)
+		return consumers_fit(g, w->need) && consumers_may_bypass(g, w->need);
+	return provider_may_leave(g);
+}
+
+static void enqueue(struct gate *g, struct gate_waiter *w)
+{
+	w->next = NULL;
+	w->prev = g->tail;
+	if (g->tail)
+		g->tail->next = w;
+	else
+		g->head = w;
+	g->tail = w;
+	if (w->is_consumer) {
+		g->consumers_waiting++;
+		g->consumers_demand += w->need;
+	} else
+		g->providers_waiting++;
+}
+
+static void dequeue(struct gate *g, struct gate_waiter *w)
+{
+	if (w->prev)
+		w->prev->next = w->next;
+	else
+		g->head = w->next;
+	if (w->next)
+		w->next->prev = w->prev;
+	else
+		g->tail = w->prev;
+	if (w->is_consumer) {
+		g->consumers_waiting--;
+		g->consumers_demand -= w->need;
+	} else if (--g->providers_waiting == 0)
+		/* Also when the last one timed out: nobody left to overtake */
+		g->bypassed = 0;
+}
+
+/* Bracket every change of the counts, for gate_snapshot() */
+static void count_begin(struct gate *g)
+{
+	g->seq++;
+	__sync_synchronize();
+}
+
+static void count_end(struct gate *g)
+{
+	__sync_synchronize();
+	g->seq++;
+}
+
+/* Apply the transition w is after */
+static void apply(struct gate *g, struct gate_waiter *w)
+{
+	count_begin(g);
+	if (w->is_consumer) {
+		if (g->providers_waiting > 0)
+			g->bypassed += w->need;
+		g->consumers += w->need;
+	} else {
+		g->providers--;
+		g->bypassed = 0;
+	}
+	count_end(g);
+}
+
+static void grant(struct gate *g, struct gate_waiter *w, struct gate_waiter *self)
+{
+	dequeue(g, w);
+	apply(g, w);
+	w->granted = 1;
+	self->signals++;
+	pthread_cond_signal(&w->cond);
+}
+
+static void wake_consumers(struct gate *g, struct gate_waiter *self)
+{
+	struct gate_waiter *w, *next;
+
+	for (w = g->head; w && g->consumers_waiting > 0 && consumers_fit(g, 1) &&
+	     consumers_may_bypass(g, 1); w = next) {
+		next = w->next;
+		if (w->is_consumer && consumers_fit(g, w->need) &&
+		    consumers_may_bypass(g, w->need))
+			grant(g, w, self);
+	}
+}
+
+static void wake_providers(struct gate *g, struct gate_waiter *self)
+{
+	struct gate_waiter *w, *next;
+
+	for (w = g->head; w && g->providers_waiting > 0 &&
+	     provider_may_leave(g); w = next) {
+		next = w->next;
+		if (!w->is_consumer)
+			grant(g, w, self);
+	}
+}
+
+/*
+ * Admit every waiter that fits after a transition: consumers first,
+ * then providers with what remains. Once consumers have used up their
+ * bypass allowance, providers go first instead; with FIFO, only the
+ * head of the queue may ever go.
+ */
+static void wake_waiters(struct gate *g, struct gate_waiter *self)
+{
+	struct gate_waiter *w;
+
+	if (g->cfg.policy == GATE_FIFO) {
+		while ((w = g->head) && (w->is_consumer ? consumers_fit(g, w->need) :
+					 provider_may_leave(g)))
+			grant(g, w, self);
+		return;
+	}
+	if (!consumers_may_bypass(g, 1))
+		wake_providers(g, self);
+	wake_consumers(g, self);
+	wake_providers(g, self);
+}
+
+static int wait_granted(struct gate *g, struct gate_waiter *w,
+	const struct timespec *abstime)
+{
+	int ret = 0;
+
+	w->granted = 0;
+	enqueue(g, w);
+	for (;;) {
+		if (abstime)
+			ret = pthread_cond_timedwait(&w->cond, &g->mutex, abstime);
+		else
+			pthread_cond_wait(&w->cond, &g->mutex);
+		if (w->granted)
+			break;
+		if (ret == ETIMEDOUT) {
+			/* Leaving the queue may unblock those behind us */
+			dequeue(g, w);
+			w->timeouts++;
+			wake_waiters(g, w);
+			return ETIMEDOUT;
+		}
+		w->wakeups++;
+		w->futile_wakeups++;
+	}
+	w->wakeups++;
+	return 0;
+}
+
+/*
+ * Lock-free mode.
+ */
+static long sys_futex(volatile int *uaddr, int op, int val,
+	const struct timespec *abstime)
+{
+	return syscall(SYS_futex, uaddr, op, val, abstime, NULL,
+		FUTEX_BITSET_MATCH_ANY);
+}
+
+static uint64_t lf_load(struct gate *g)
+{
+	return __atomic_load_n(&g->state, __ATOMIC_SEQ_CST);
+}
+
+static int lf_consumers_fit(struct gate *g, uint64_t s, int k)
+{
+	return GATE_CONSUMERS(s) + k <= GATE_PROVIDERS(s) * g->cfg.ratio;
+}
+
+static int lf_provider_may_leave(struct gate *g, uint64_t s)
+{
+	return (GATE_PROVIDERS(s) - 1) * g->cfg.ratio >= GATE_CONSUMERS(s);
+}
+
+static int lf_fits(struct gate *g, struct gate_waiter *w, uint64_t s)
+{
+	return w->is_consumer ? lf_consumers_fit(g, s, w->need) :
+		lf_provider_may_leave(g, s);
+}
+
+/*
+ * Sleep on the futex word until a transition bumps it, unless the
+ * state already lets us through. We announce ourselves before
+ * sampling word and state, so a waker either sees us as a sleeper
+ * or has already changed the state we are about to check.
+ * FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline.
+ */
+static int lf_wait(struct gate *g, struct gate_waiter *w, volatile int *word,
+	volatile int *sleepers, const struct timespec *abstime)
+{
+	int seq, ret = 0;
+
+	__sync_add_and_fetch(sleepers, 1);
+	if (w->is_consumer)
+		__sync_add_and_fetch(&g->consumer_sleepers_demand, w->need);
+	seq = *word;
+	if (!lf_fits(g, w, lf_load(g))) {
+		if (sys_futex(word, FUTEX_WAIT_BITSET_PRIVATE, seq, abstime) < 0 &&
+		    errno == ETIMEDOUT)
+			ret = ETIMEDOUT;
+		w->wakeups++;
+	}
+	__sync_sub_and_fetch(sleepers, 1);
+	if (w->is_consumer)
+		__sync_sub_and_fetch(&g->consumer_sleepers_demand, w->need);
+	return ret;
+}
+
+/* Wake up to n sleepers, after the state has been updated */
+static void lf_wake(struct gate_waiter *self, volatile int *word,
+	volatile int *sleepers, int n)
+{
+	__sync_add_and_fetch(word, 1);
+	if (*sleepers > 0) {
+		sys_futex(word, FUTEX_WAKE_PRIVATE, n, NULL);
+		self->signals++;
+	}
+}
+
+/*
+ * CAS our transition in as soon as it fits. Returns EBUSY for the
+ * try variants instead of sleeping.
+ */
+static int lf_transition(struct gate *g, struct gate_waiter *w, int64_t delta,
+	int try, const struct timespec *abstime)
+{
+	volatile int *word, *sleepers;
+	uint64_t s;
+	int woken = 0;
+
+	word = w->is_consumer ? &g->consumer_futex : &g->provider_futex;
+	sleepers = w->is_consumer ? &g->consumer_sleepers : &g->provider_sleepers;
+	for (;;) {
+		s = lf_load(g);
+		if (lf_fits(g, w, s)) {
+			if (__sync_bool_compare_and_swap(&g->state, s, s + delta))
+				return 0;
+			continue;
+		}
+		if (try)
+			return EBUSY;
+		if (woken)
+			w->futile_wakeups++;
+		if (lf_wait(g, w, word, sleepers, abstime) == ETIMEDOUT) {
+			w->timeouts++;
+			return ETIMEDOUT;
+		}
+		woken = 1;
+	}
+}
+
+/*
+ * The API.
+ */
+void gate_enter_provider(struct gate *g, struct gate_waiter *w)
+{
+	if (g->cfg.lockfree) {
+		__sync_add_and_fetch(&g->state, GATE_ONE_PROVIDER);
+		lf_wake(w, &g->consumer_futex, &g->consumer_sleepers, g->cfg.ratio);
+		lf_wake(w, &g->provider_futex, &g->provider_sleepers, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&g->mutex);
+	count_begin(g);
+	g->providers++;
+	count_end(g);
+	wake_waiters(g, w);
+	pthread_mutex_unlock(&g->mutex);
+}
+
+static int exit_provider(struct gate *g, struct gate_waiter *w, int try,
+	const struct timespec *abstime)
+{
+	int ret = 0;
+
+	w->is_consumer = 0;
+	w->need = 1;
+	if (g->cfg.lockfree) {
+		ret = lf_transition(g, w, -(int64_t)GATE_ONE_PROVIDER, try, abstime);
+		/* Another waiting provider may be able to leave as well */
+		if (ret == 0)
+			lf_wake(w, &g->provider_futex, &g->provider_sleepers, 1);
+		return ret;
+	}
+
+	pthread_mutex_lock(&g->mutex);
+	if (may_go_now(g, w)) {
+		apply(g, w);
+		/* Consumers held back by the bypass limit may go again */
+		if (g->cfg.policy == GATE_BOUNDED)
+			wake_waiters(g, w);
+	} else if (try)
+		ret = EBUSY;
+	else
+		ret = wait_granted(g, w, abstime);
+	pthread_mutex_unlock(&g->mutex);
+	return ret;
+}
+
+int gate_exit_provider(struct gate *g, struct gate_waiter *w,
+	const struct timespec *abstime)
+{
+	return exit_provider(g, w, 0, abstime);
+}
+
+int gate_try_exit_provider(struct gate *g, struct gate_waiter *w)
+{
+	return exit_provider(g, w, 1, NULL);
+}
+
+static int enter_consumers(struct gate *g, struct gate_waiter *w, int k,
+	int try, const struct timespec *abstime)
+{
+	int ret = 0;
+
+	w->is_consumer = 1;
+	w->need = k;
+	if (g->cfg.lockfree)
+		return lf_transition(g, w, k * GATE_ONE_CONSUMER, try, abstime);
+
+	pthread_mutex_lock(&g->mutex);
+	if (may_go_now(g, w))
+		apply(g, w);
+	else if (try)
+		ret = EBUSY;
+	else
+		ret = wait_granted(g, w, abstime);
+	pthread_mutex_unlock(&g->mutex);
+	return ret;
+}
+
+int gate_enter_consumers(struct gate *g, struct gate_waiter *w, int k,
+	const struct timespec *abstime)
+{
+	return enter_consumers(g, w, k, 0, abstime);
+}
+
+int gate_try_enter_consumers(struct gate *g, struct gate_waiter *w, int k)
+{
+	return enter_consumers(g, w, k, 1, NULL);
+}
+
+void gate_exit_consumers(struct gate *g, struct gate_waiter *w, int k)
+{
+	if (g->cfg.lockfree) {
+		__sync_sub_and_fetch(&g->state, k * GATE_ONE_CONSUMER);
+		lf_wake(w, &g->consumer_futex, &g->consumer_sleepers, k);
+		lf_wake(w, &g->provider_futex, &g->provider_sleepers, 1);
+		return;
+	}
+
+	pthread_mutex_lock(&g->mutex);
+	count_begin(g);
+	g->consumers -= k;
+	count_end(g);
+	wake_waiters(g, w);
+	pthread_mutex_unlock(&g->mutex);
+}
+
+void gate_snapshot(struct gate *g, int *providers, int *consumers)
+{
+	unsigned int seq;
+	uint64_t s;
+
+	if (g->cfg.lockfree) {
+		/* A single load gives a consistent snapshot */
+		s = lf_load(g);
+		*providers = GATE_PROVIDERS(s);
+		*consumers = GATE_CONSUMERS(s);
+		return;
+	}
+
+	/* Retry until the same even seq is seen before and after */
+	do {
+		while ((seq = __atomic_load_n(&g->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		*providers = g->providers;
+		*consumers = g->consumers;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (g->seq != seq);
+}
+
+/*
+ * The hints read the counters without the lock, so they may be a
+ * little stale or, in mutex mode, even mix two states.
+ */
+int gate_free_slots(struct gate *g)
+{
+	uint64_t s;
+
+	if (g->cfg.lockfree) {
+		s = lf_load(g);
+		return GATE_PROVIDERS(s) * g->cfg.ratio - GATE_CONSUMERS(s);
+	}
+	return g->providers * g->cfg.ratio - g->consumers;
+}
+
+int gate_consumers_waiting(struct gate *g)
+{
+	if (g->cfg.lockfree)
+		return g->consumer_sleepers_demand;
+	return *(volatile int *)&g->consumers_demand;
+}
@@ -0,0 +1,130 @@
+/*
+ * gate-lib.h
+ *
+ * A ratio admission gate: consumers may only be inside while there
+ * are at least 1/ratio providers per consumer. Providers come in
+ * freely, but may only leave if the consumers they leave behind
+ * still fit. This is the kindergarten rule (teachers provide,
+ * children consume), packaged for reuse.
+ *
+ */
+
+#ifndef GATE_LIB_H__
+#define GATE_LIB_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Order in which waiters are admitted, mutex mode only */
+enum gate_policy {
+	GATE_BARGING,	/* Whoever fits goes; a waiting provider can starve */
+	GATE_FIFO,	/* Strict arrival order */
+	GATE_BOUNDED	/* At most max_bypass consumers overtake a waiting provider */
+};
+
+struct gate_config {
+	int ratio;		/* Consumers allowed per provider */
+	int lockfree;		/* CAS on a packed word, futex sleeps, barging only */
+	enum gate_policy policy;
+	int max_bypass;		/* For GATE_BOUNDED */
+	char name[24];		/* As given to gate_parse_policy(), if it was */
+};
+
+/*
+ * Per-thread context, passed to every call. In mutex mode a blocked
+ * thread queues this and sleeps on its own condition variable; the
+ * thread that makes room admits it directly and signals only it.
+ */
+struct gate_waiter {
+	pthread_cond_t cond;
+	struct gate_waiter *prev, *next;
+	int is_consumer;
+	int need;		/* Consumers to admit in one go */
+	int granted;
+
+	/* Statistics, only ever touched by the owner or under the gate lock */
+	long signals;		/* cond signals / futex wakes issued */
+	long wakeups;
+	long futile_wakeups;	/* Woken up, but still could not proceed */
+	long timeouts;
+};
+
+struct gate {
+	struct gate_config cfg;
+
+	/*
+	 * Mutex mode. The counts are only written under the mutex,
+	 * and seq is odd while they change, so gate_snapshot() can
+	 * read them like a seqlock without taking the mutex.
+	 */
+	pthread_mutex_t mutex;
+	volatile unsigned int seq;
+	volatile int providers, consumers;
+	struct gate_waiter *head, *tail;	/* Blocked threads, in arrival order */
+	int providers_waiting, consumers_waiting;
+	int consumers_demand;	/* Consumers the waiting ones want to admit */
+	int bypassed;		/* Consumers admitted past a waiting provider */
+
+	/*
+	 * Lock-free mode: providers in the upper and consumers in the
+	 * lower 32 bits of one word. Blocked threads sleep on a futex
+	 * word that is bumped whenever a transition may let them through.
+	 */
+	volatile uint64_t state __attribute__((aligned(64)));
+	volatile int consumer_futex, provider_futex;
+	volatile int consumer_sleepers, provider_sleepers;
+	volatile int consumer_sleepers_demand;	/* Like consumers_demand */
+};
+
+/* Function prototypes */
+int gate_parse_policy(const char *s, struct gate_config *cfg);
+const char *gate_policy_name(const struct gate_config *cfg);
+int gate_init(struct gate *g, const struct gate_config *cfg);
+void gate_destroy(struct gate *g);
+int gate_waiter_init(struct gate_waiter *w);
+void gate_waiter_destroy(struct gate_waiter *w);
+void gate_deadline(struct timespec *ts, long us);
+
+/*
+ * The blocking calls take an absolute CLOCK_MONOTONIC deadline
+ * (NULL waits forever) and return 0 or ETIMEDOUT; the try calls
+ * never block and return 0 or EBUSY. Batch calls admit or release
+ * k consumers at once, all or nothing, under a single lock round trip.
+ */
+void gate_enter_provider(struct gate *g, struct gate_waiter *w);
+int gate_exit_provider(struct gate *g, struct gate_waiter *w,
+	const struct timespec *abstime);
+int gate_try_exit_provider(struct gate *g, struct gate_waiter *w);
+int gate_enter_consumers(struct gate *g, struct gate_waiter *w, int k,
+	const struct timespec *abstime);
+int gate_try_enter_consumers(struct gate *g, struct gate_waiter *w, int k);
+void gate_exit_consumers(struct gate *g, struct gate_waiter *w, int k);
+
+static inline int gate_enter_consumer(struct gate *g, struct gate_waiter *w,
+	const struct timespec *abstime)
+{
+	return gate_enter_consumers(g, w, 1, abstime);
+}
+
+static inline int gate_try_enter_consumer(struct gate *g, struct gate_waiter *w)
+{
+	return gate_try_enter_consumers(g, w, 1);
+}
+
+static inline void gate_exit_consumer(struct gate *g, struct gate_waiter *w)
+{
+	gate_exit_consumers(g, w, 1);
+}
+
+/* A consistent (providers, consumers) pair, never takes the mutex */
+void gate_snapshot(struct gate *g, int *providers, int *consumers);
+
+/*
+ * Unlocked hints, for load balancing across gates. A blocked batch
+ * of k consumers counts as k waiting consumers.
+ */
+int gate_free_slots(struct gate *g);
+int gate_consumers_waiting(struct gate *g);
+
+#endif /* GATE_LIB_H__ */
@@ -0,0 +1,117 @@
+/*
+ * hist-lib.c
+ *
+ * Log-linear latency histograms: constant memory, cheap to update
+ * from every thread, mergeable, and good to about 6% for percentiles.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "hist-lib.h"
+
+/*
+ * Values below HIST_SUB get a bucket each. Above that, the bucket is
+ * picked by the position of the top bit plus the HIST_SUB_BITS bits
+ * right below it.
+ */
+static int bucket_of(uint64_t v)
+{
+	int e;
+
+	if (v < HIST_SUB)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Smallest value that falls into bucket idx */
+static uint64_t bucket_low(int idx)
+{
+	int e;
+
+	if (idx < HIST_SUB)
+		return idx;
+	e = idx / HIST_SUB + HIST_SUB_BITS - 1;
+	return ((uint64_t)1 << e) |
+		((uint64_t)(idx % HIST_SUB) << (e - HIST_SUB_BITS));
+}
+
+void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_add(struct hist *h, uint64_t v)
+{
+	h->b[bucket_of(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->b[i] += src->b[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*
+ * Value below which a fraction p (0..1) of the samples fall,
+ * reported as the lower edge of its bucket (never above max).
+ */
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	unsigned long rank, seen = 0;
+	uint64_t v;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	rank = p * h->count;
+	if (rank >= h->count)
+		rank = h->count - 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->b[i];
+		if (seen > rank)
+			break;
+	}
+	v = bucket_low(i);
+	return v > h->max ? h->max : v;
+}
+
+/* Format a nanosecond value with a sensible unit */
+static void fmt_ns(char *buf, size_t len, double ns)
+{
+	if (ns < 1e3)
+		snprintf(buf, len, "%.0fns", ns);
+	else if (ns < 1e6)
+		snprintf(buf, len, "%.1fus", ns / 1e3);
+	else if (ns < 1e9)
+		snprintf(buf, len, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, len, "%.2fs", ns / 1e9);
+}
+
+void hist_print_ns(FILE *fp, const char *label, const struct hist *h)
+{
+	char p50[32], p99[32], max[32], mean[32];
+
+	fmt_ns(p50, sizeof(p50), hist_percentile(h, 0.50));
+	fmt_ns(p99, sizeof(p99), hist_percentile(h, 0.99));
+	fmt_ns(max, sizeof(max), h->max);
+	fmt_ns(mean, sizeof(mean), h->count ? h->sum / h->count : 0);
+
+	fprintf(fp, "%s: n=%lu p50 %s p99 %s max %s mean %s\n",
+		label, h->count, p50, p99, max, mean);
+}
@@ -0,0 +1,34 @@
+/*
+ * hist-lib.h
+ *
+ * Log-linear latency histograms: constant memory, cheap to update
+ * from every thread, mergeable, and good to about 6% for percentiles.
+ *
+ */
+
+#ifndef HIST_LIB_H__
+#define HIST_LIB_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* Every power of two is split into HIST_SUB linear buckets */
+#define HIST_SUB_BITS   4
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS    (64 * HIST_SUB)
+
+struct hist {
+	unsigned long count;
+	uint64_t max;
+	double sum;
+	unsigned long b[HIST_BUCKETS];
+};
+
+/* Function prototypes */
+void hist_init(struct hist *h);
+void hist_add(struct hist *h, uint64_t v);
+void hist_merge(struct hist *dst, const struct hist *src);
+uint64_t hist_percentile(const struct hist *h, double p);
+void hist_print_ns(FILE *fp, const char *label, const struct hist *h);
+
+#endif /* HIST_LIB_H__ */
@@ -20,9 +20,20 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <stdint.h>
+#include <math.h>
+#include <limits.h>
+
+#include "perf-lib.h"
+#include "log-lib.h"
+#include "hist-lib.h"
+#include "gate-lib.h"
+#include "trace-lib.h"
 
 /*
  * POSIX thread functions do not return error numbers in errno,
@@ -40,7 +51,17 @@ struct kgarten_struct {
          * you may need.
          */
 
-        pthread_cond_t cond;
+        /*
+         * The ratio rule is enforced by a gate (see gate-lib.c), with
+         * teachers as providers and children as consumers. It keeps its
+         * own counts; vt and vc below are left at zero, and
+         * gate_snapshot() is the way to read the state.
+         * Aligned so that rooms (-R) never share a cache line.
+         */
+        struct gate gate __attribute__((aligned(64)));
+
+        /* Multi-room mode (-R): entries into this room, for the report */
+        volatile long admitted;
 
         /*
          * You may NOT modify anything in the structure below this
@@ -66,8 +87,155 @@ struct thread_info_struct {
         int thrid;     /* Application-defined thread id */
         int thrcnt;
         unsigned int rseed;
+        unsigned int room_seed; /* Room choices, kept apart from the dwell times */
+
+        struct perf_counters pc; /* Filled in only if use_perf is set */
+
+        /* Our side of the gate; also counts signals, wakeups and timeouts */
+        struct gate_waiter gw;
+
+        struct trace_buf tb;     /* Used only if trace_prefix is set */
+
+        /* Per-thread statistics, summed up at the end of the run */
+        struct hist enter_wait;  /* Children: time spent in child_enter() */
+        struct hist exit_wait;   /* Teachers: time spent in teacher_exit() */
+        long entries;
+        long transitions;
+        long busy;               /* -Y: attempts that found the gate busy */
+};
+
+/*
+ * Gate settings shared by all rooms: -L selects the lock-free gate,
+ * -F the fairness policy of the mutex one (barging by default).
+ */
+struct gate_config gate_cfg = { 0, 0, GATE_BARGING, 0 };
+
+/* Children give up on a visit after waiting this long (-T), 0 = never */
+int child_timeout_us = 0;
+
+/*
+ * Each child thread brings a group of this many children (-G), who
+ * only ever go in and out together.
+ */
+int group = 1;
+
+/*
+ * With -Y, nobody waits at the gate: a child that does not fit goes
+ * back out to play, a teacher who may not leave stays another while.
+ */
+int try_mode = 0;
+
+/*
+ * Tracing goes through per-thread log rings (see log-lib.c)
+ * instead of stdio, so threads never serialize on the stderr lock.
+ * -v 0 turns it off, 1 logs transitions and checks, 2 logs everything.
+ */
+int verbosity = 2;
+
+enum kg_log_event {
+        EV_START, EV_END,
+        EV_ENTERING, EV_ENTERED, EV_EXITING, EV_EXITED,
+        EV_CHILD_ENTER, EV_CHILD_EXIT, EV_TEACHER_ENTER, EV_TEACHER_EXIT,
+        EV_VERIFY, EV_GAVE_UP
+};
+
+#define kg_log(thr, level, ev, a, b) \
+        do { if (verbosity >= (level)) log_event((thr)->thrid, ev, a, b); } while (0)
+
+/*
+ * Binary record/replay trace (-t prefix): one memory-mapped file per
+ * thread, prefix.<thrid>, read back and analyzed by kgtrace.
+ */
+char *trace_prefix = NULL;
+
+#define kg_trace(thr, ev) \
+        do { \
+                if (trace_prefix) \
+                        trace_event(&(thr)->tb, now_ns(), (thr)->thrid, \
+                                    (thr)->kg - rooms, ev); \
+        } while (0)
+
+/* Nonzero if -p was given: capture perf counters around the main loop */
+int use_perf = 0;
+
+/* Number of enter/exit iterations per thread, 0 means run forever */
+int nloops = 0;
+
+/*
+ * Dwell time distributions, in microseconds (-I inside, -O outside).
+ * The default is uniform in [0, 1s) inside and [0, 100ms) outside.
+ */
+enum dwell_kind { DWELL_UNIFORM, DWELL_EXP, DWELL_FIXED };
+
+struct dwell {
+        enum dwell_kind kind;
+        int us;         /* Upper bound, mean or fixed value */
 };
 
+struct dwell inside_dwell = { DWELL_UNIFORM, 1000000 };
+struct dwell outside_dwell = { DWELL_UNIFORM, 100000 };
+
+/*
+ * Real sleeps are divided by sleep_div (-S); 0 means do not sleep
+ * at all. The random draws are still made, so a given seed produces
+ * the same sequence of dwell times whatever the scale.
+ */
+int sleep_div = 1;
+
+/* Stop after this many seconds (-d), 0 means no time limit */
+int duration = 0;
+struct timespec deadline;
+
+/*
+ * Multi-room mode (-R): nrooms independent kindergartens, each with
+ * its own lock, counters and ratio. Children pick one of two random
+ * rooms, the one with more free slots; teachers go where they are
+ * needed most. thr->kg points to the room of the current iteration.
+ */
+int nrooms = 1;
+struct kgarten_struct *rooms;
+
+/* Nonzero if -V was given: discrete-event simulation in virtual time */
+int simulate = 0;
+
+/*
+ * Child threads that have not finished their iterations yet.
+ * Teachers stay on duty until this drops to zero, otherwise
+ * the last children would wait forever for a teacher to enter.
+ */
+volatile int children_active;
+
+/*
+ * Occupancy over time: share of time (or of samples) spent with
+ * vc / (vt * ratio) in each tenth, plus "no teachers" and "full".
+ */
+#define OCC_BINS        12
+
+struct occupancy {
+        double weight[OCC_BINS];
+        double vt_sum, vc_sum, total;
+};
+
+struct occupancy occ;
+
+/*
+ * The sampler thread snapshots every room SAMPLE_HZ times a second
+ * for the occupancy report, on every threaded run.
+ */
+#define SAMPLE_HZ       100
+
+long samples;
+
+/*
+ * With -A, an auditor thread snapshots every room audit_hz times a
+ * second and checks the ratio, and the threads stop calling verify()
+ * themselves.
+ */
+int audit_hz = 0;
+int inline_verify = 1;
+long audits;
+volatile int watchers_stop;
+
 int safe_atoi(char *s, int *val)
 {
         long l;
@@ -95,17 +263,98 @@ void *safe_malloc(size_t size)
         return p;
 }
 
+uint64_t now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 void usage(char *argv0)
 {
-        fprintf(stderr, "Usage: %s thread_count child_threads c_t_ratio\n\n"
-                "Exactly two argument required:\n"
+        fprintf(stderr, "Usage: %s [-p] [-L] [-V] [-Y] [-n loops] [-d secs] [-s seed] [-S div]\n"
+                "          [-I dist] [-O dist] [-R rooms] [-F policy] [-T ms] [-A hz]\n"
+                "          [-G size] [-t prefix] [-v level]\n"
+                "          thread_count child_threads c_t_ratio\n\n"
+                "Exactly three arguments required:\n"
                 "    thread_count: Total number of threads to create.\n"
                 "    child_threads: The number of threads simulating children.\n"
-                "    c_t_ratio: The allowed ratio of children to teachers.\n\n",
+                "    c_t_ratio: The allowed ratio of children to teachers.\n\n"
+                "Options:\n"
+                "    -p: Capture per-thread performance counters around the\n"
+                "        main loop (falls back to getrusage without permission).\n"
+                "    -L: Lock-free admission on a packed atomic (vt, vc) word,\n"
+                "        sleeping on a futex only when the ratio would break.\n"
+                "    -V: Do not run threads; simulate the kindergarten with a\n"
+                "        virtual clock. Needs -n or -d.\n"
+                "    -Y: Never wait at the gate: children that do not fit go back\n"
+                "        out to play, teachers who may not leave stay a while longer.\n"
+                "    -n loops: Stop each thread after this many iterations\n"
+                "        (default: run forever).\n"
+                "    -d secs: Stop after this many (virtual, with -V) seconds.\n"
+                "    -s seed: Seed for the dwell times (default: time of day).\n"
+                "    -S div: Divide all sleeps by div, 0 = never sleep (default 1).\n"
+                "    -I dist, -O dist: Time spent inside / outside, in microseconds:\n"
+                "        uniform:MAX, exp:MEAN or fixed:US\n"
+                "        (default uniform:1000000 inside, uniform:100000 outside).\n"
+                "    -R rooms: Split the kindergarten into this many rooms, each\n"
+                "        with its own lock and the same ratio (default 1).\n"
+                "    -F policy: Fairness of the mutex mode: barging (default),\n"
+                "        fifo, teacher (waiting teachers go first) or bounded:K\n"
+                "        (at most K children overtake a waiting teacher).\n"
+                "    -T ms: Children give up on a visit after waiting this long.\n"
+                "    -G size: Children come in groups of this size, which go in\n"
+                "        and out together (default 1).\n"
+                "    -A hz: Leave all checking to an auditor thread, which\n"
+                "        snapshots every room hz times a second (default: threads\n"
+                "        check on every iteration).\n"
+                "    -t prefix: Record a binary trace of every transition into\n"
+                "        prefix.0, prefix.1, ... (one file per thread), for kgtrace.\n"
+                "    -v level: Trace verbosity on stderr: 0 = off, 1 = transitions\n"
+                "        and checks only, 2 = everything (default 2).\n\n",
                 argv0);
         exit(1);
 }
 
+/*
+ * Turn a binary log record back into the usual trace line.
+ * Runs in the drainer thread.
+ */
+int kg_format_log(char *buf, size_t len, const struct log_rec *rec)
+{
+        static char *verb[] = { "Entering", "Entered", "Exiting", "Exited" };
+        static char *transition[] = {
+                "CHILD ENTER", "CHILD EXIT", "TEACHER ENTER", "TEACHER EXIT"
+        };
+
+        switch (rec->event) {
+        case EV_START:
+                return snprintf(buf, len, "Thread %d of %d. START.\n",
+                                rec->thrid, rec->a);
+        case EV_END:
+                return snprintf(buf, len, "Thread %d of %d. END.\n",
+                                rec->thrid, rec->a);
+        case EV_ENTERING: case EV_ENTERED: case EV_EXITING: case EV_EXITED:
+                return snprintf(buf, len, "Thread %d [%s]: %s.\n", rec->thrid,
+                                rec->a ? "Child" : "Teacher",
+                                verb[rec->event - EV_ENTERING]);
+        case EV_CHILD_ENTER: case EV_CHILD_EXIT:
+        case EV_TEACHER_ENTER: case EV_TEACHER_EXIT:
+                return snprintf(buf, len, "THREAD %d: %s\n", rec->thrid,
+                                transition[rec->event - EV_CHILD_ENTER]);
+        case EV_GAVE_UP:
+                return snprintf(buf, len, "Thread %d [%s]: Gave up waiting.\n",
+                                rec->thrid, rec->a ? "Child" : "Teacher");
+        case EV_VERIFY:
+                return snprintf(buf, len, "Thread %d: Teachers: %d, Children: %d\n",
+                                rec->thrid, rec->a, rec->b);
+        default:
+                return snprintf(buf, len, "Thread %d: event %d (%d, %d)\n",
+                                rec->thrid, rec->event, rec->a, rec->b);
+        }
+}
+
 void bad_thing(int thrid, int children, int teachers)
 {
         int thing, sex;
@@ -140,7 +389,10 @@ void bad_thing(int thrid, int children, int teachers)
         name = sex ? boys[nameidx] : girls[nameidx];
 
         p = buf;
-        p += sprintf(p, "*** Thread %d: Oh no! ", thrid);
+        if (thrid < 0)
+                p += sprintf(p, "*** Auditor: Oh no! ");
+        else
+                p += sprintf(p, "*** Thread %d: Oh no! ", thrid);
         p += sprintf(p, things[thing], name, sex ? "his" : "her");
         p += sprintf(p, "\n*** Why were there only %d teachers for %d children?!\n",
                 teachers, children);
@@ -149,22 +401,60 @@ void bad_thing(int thrid, int children, int teachers)
         printf("%s", buf);
 }
 
+/*
+ * Report a ratio violation and bail out. The log rings are drained
+ * first, so the records leading up to it still reach stderr; the
+ * mutex keeps a second thread that trips at the same time from
+ * exiting halfway through.
+ */
+void violation(int thrid, int children, int teachers)
+{
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+        pthread_mutex_lock(&lock);
+        bad_thing(thrid, children, teachers);
+        log_flush();
+        exit(1);
+}
+
 
-void child_enter(struct thread_info_struct *thr)
+/*
+ * Returns 0 once inside, ETIMEDOUT if -T is set and the child
+ * waited that long without getting in, or EBUSY with -Y.
+ */
+int child_enter(struct thread_info_struct *thr)
 {
+        struct timespec deadline;
+        int ret;
+
         if (!thr->is_child) {
                 fprintf(stderr, "Internal error: %s called for a Teacher thread.\n",
                         __func__);
                 exit(1);
         }
 
-        fprintf(stderr, "THREAD %d: CHILD ENTER\n", thr->thrid);
-
-        pthread_mutex_lock(&thr->kg->mutex);
-        while(((thr->kg->vc)+1) > (thr->kg->vt)*(thr->kg->ratio))
-            pthread_cond_wait(&thr->kg->cond, &thr->kg->mutex);
-        ++(thr->kg->vc);
-        pthread_mutex_unlock(&thr->kg->mutex);
+        kg_log(thr, 1, EV_CHILD_ENTER, 0, 0);
+        kg_trace(thr, TR_CHILD_ENTER);
+
+        thr->transitions++;
+        if (try_mode)
+                ret = gate_try_enter_consumers(&thr->kg->gate, &thr->gw, group);
+        else {
+                if (child_timeout_us)
+                        gate_deadline(&deadline, child_timeout_us);
+                ret = gate_enter_consumers(&thr->kg->gate, &thr->gw, group,
+                                           child_timeout_us ? &deadline : NULL);
+        }
+        if (ret == 0) {
+                kg_trace(thr, TR_CHILD_ENTERED);
+                return 0;
+        }
+        thr->transitions--;
+        if (ret == EBUSY)
+                thr->busy++;
+        kg_log(thr, 1, EV_GAVE_UP, 1, 0);
+        kg_trace(thr, TR_GAVE_UP);
+        return ret;
 }
 
 void child_exit(struct thread_info_struct *thr)
@@ -176,13 +466,12 @@ void child_exit(struct thread_info_struct *thr)
                 exit(1);
         }
 
-        fprintf(stderr, "THREAD %d: CHILD EXIT\n", thr->thrid);
+        kg_log(thr, 1, EV_CHILD_EXIT, 0, 0);
+        kg_trace(thr, TR_CHILD_EXIT);
 
-        pthread_mutex_lock(&thr->kg->mutex);
-        --(thr->kg->vc);
-        //if((thr->kg->vc) <= ((thr->kg->vt)-1)*(thr->kg->ratio))
-        pthread_cond_broadcast(&thr->kg->cond);
-        pthread_mutex_unlock(&thr->kg->mutex);
+        thr->transitions++;
+        gate_exit_consumers(&thr->kg->gate, &thr->gw, group);
+        kg_trace(thr, TR_CHILD_EXITED);
 }
 
 void teacher_enter(struct thread_info_struct *thr)
@@ -193,16 +482,19 @@ void teacher_enter(struct thread_info_struct *thr)
                 exit(1);
         }
 
-        fprintf(stderr, "THREAD %d: TEACHER ENTER\n", thr->thrid);
+        kg_log(thr, 1, EV_TEACHER_ENTER, 0, 0);
+        kg_trace(thr, TR_TEACHER_ENTER);
 
-        pthread_mutex_lock(&thr->kg->mutex);
-        ++(thr->kg->vt);
-        //if(((thr->kg->vc)+1) <= (thr->kg->vt)*(thr->kg->ratio))
-        pthread_cond_broadcast(&thr->kg->cond);
-        pthread_mutex_unlock(&thr->kg->mutex);
+        thr->transitions++;
+        gate_enter_provider(&thr->kg->gate, &thr->gw);
+        kg_trace(thr, TR_TEACHER_ENTERED);
 }
 
-void teacher_exit(struct thread_info_struct *thr)
+/*
+ * Returns 0 once outside, or EBUSY if -Y is set and leaving now
+ * would break the ratio.
+ */
+int teacher_exit(struct thread_info_struct *thr)
 {
         if (thr->is_child) {
                 fprintf(stderr, "Internal error: %s called for a Child thread.\n",
@@ -210,36 +502,246 @@ void teacher_exit(struct thread_info_struct *thr)
                 exit(1);
         }
 
-        fprintf(stderr, "THREAD %d: TEACHER EXIT\n", thr->thrid);
+        kg_log(thr, 1, EV_TEACHER_EXIT, 0, 0);
+        kg_trace(thr, TR_TEACHER_EXIT);
+
+        thr->transitions++;
+        if (!try_mode)
+                gate_exit_provider(&thr->kg->gate, &thr->gw, NULL);
+        else if (gate_try_exit_provider(&thr->kg->gate, &thr->gw) == EBUSY) {
+                thr->transitions--;
+                thr->busy++;
+                kg_log(thr, 1, EV_GAVE_UP, 0, 0);
+                kg_trace(thr, TR_GAVE_UP);
+                return EBUSY;
+        }
+        kg_trace(thr, TR_TEACHER_EXITED);
+        return 0;
+}
+
+/*
+ * Room selection. The gate counters are read without the lock,
+ * so the result is only a hint; admission itself is still exact.
+ * Children use power of two choices: sample two rooms, take the
+ * emptier one.
+ */
+struct kgarten_struct *pick_child_room(struct thread_info_struct *thr)
+{
+        struct kgarten_struct *a, *b;
+
+        if (nrooms == 1)
+                return rooms;
+        a = &rooms[rand_r(&thr->room_seed) % nrooms];
+        b = &rooms[rand_r(&thr->room_seed) % nrooms];
+        return gate_free_slots(&a->gate) >= gate_free_slots(&b->gate) ? a : b;
+}
+
+/*
+ * Where a teacher helps most: among the rooms short of slots for the
+ * children already waiting there, the one that is the fewest teachers
+ * short, then the one with the largest shortage. A waiting group (-G)
+ * counts with all its children, so teachers gather where a group is
+ * blocked until there are enough of them for it, instead of spreading
+ * out one per room. here is the room the teacher is in, counted as if
+ * it had left, or NULL. Scanning starts at a different room for each
+ * teacher, so ties spread the teachers out.
+ */
+struct kgarten_struct *pick_teacher_room(struct thread_info_struct *thr,
+                                         struct kgarten_struct *here)
+{
+        struct kgarten_struct *kg, *best = NULL;
+        int i, need, short_by, best_need = 0, best_short_by = 0;
+
+        for (i = 0; i < nrooms; i++) {
+                kg = &rooms[(thr->thrid + i) % nrooms];
+                need = gate_consumers_waiting(&kg->gate) - gate_free_slots(&kg->gate);
+                if (kg == here)
+                        need += kg->ratio;
+                short_by = need > 0 ? (need + kg->ratio - 1) / kg->ratio : INT_MAX;
+                if (!best || short_by < best_short_by ||
+                    (short_by == best_short_by && need > best_need)) {
+                        best = kg;
+                        best_need = need;
+                        best_short_by = short_by;
+                }
+        }
+        return best;
+}
+
+/*
+ * With groups (-G) in several rooms, a teacher who leaves a room
+ * where a group is blocked undoes the work of the next one to come
+ * in. Stay on duty for as long as this room is where we help most.
+ */
+int teacher_should_stay(struct thread_info_struct *thr)
+{
+        if (group == 1 || nrooms == 1 || children_active == 0)
+                return 0;
+        return pick_teacher_room(thr, thr->kg) == thr->kg;
+}
 
-        pthread_mutex_lock(&thr->kg->mutex);
-        while((thr->kg->vt-1)*thr->kg->ratio < thr->kg->vc)
-            pthread_cond_wait(&thr->kg->cond, &thr->kg->mutex);
-        --(thr->kg->vt);
-        pthread_mutex_unlock(&thr->kg->mutex);
+void occupancy_add(struct occupancy *o, int t, int c, int ratio, double w)
+{
+        int bin;
+
+        if (t == 0)
+                bin = 0;
+        else if (c >= t * ratio)
+                bin = OCC_BINS - 1;
+        else
+                bin = 1 + 10 * c / (t * ratio);
+        o->weight[bin] += w;
+        o->vt_sum += t * w;
+        o->vc_sum += c * w;
+        o->total += w;
 }
 
 /*
- * Verify the state of the kindergarten.
+ * Sample the occupancy of every room while children are still
+ * running. gate_snapshot() never takes the gate mutex, so neither
+ * the sampler nor the auditor adds to the lock traffic of the
+ * threads they are watching.
+ */
+void *sampler_fn(void *arg)
+{
+        struct kgarten_struct *kg;
+        int i, t, c;
+
+        while (!watchers_stop && children_active > 0) {
+                for (i = 0; i < nrooms; i++) {
+                        kg = &rooms[i];
+                        gate_snapshot(&kg->gate, &t, &c);
+                        occupancy_add(&occ, t, c, kg->ratio, 1);
+                        samples++;
+                }
+                usleep(1000000 / SAMPLE_HZ);
+        }
+        return NULL;
+}
+
+/* Check every room while children are still running (-A) */
+void *auditor_fn(void *arg)
+{
+        struct kgarten_struct *kg;
+        int i, t, c;
+
+        while (!watchers_stop && children_active > 0) {
+                for (i = 0; i < nrooms; i++) {
+                        kg = &rooms[i];
+                        gate_snapshot(&kg->gate, &t, &c);
+                        if (c > t * kg->ratio)
+                                violation(-1, c, t);
+                        audits++;
+                }
+                usleep(1000000 / audit_hz);
+        }
+        return NULL;
+}
+
+/*
+ * Verify the state of the kindergarten (of the current room, with -R).
+ * The snapshot is lock-free, see gate_snapshot().
  */
 void verify(struct thread_info_struct *thr)
 {
         struct kgarten_struct *kg = thr->kg;
         int t, c, r;
 
-        c = kg->vc;
-        t = kg->vt;
+        if (!inline_verify)
+                return;
+
+        gate_snapshot(&kg->gate, &t, &c);
         r = kg->ratio;
 
-        fprintf(stderr, "Thread %d: Teachers: %d, Children: %d\n",
-                thr->thrid, t, c);
+        kg_log(thr, 1, EV_VERIFY, t, c);
 
-        if (c > t * r) {
-                bad_thing(thr->thrid, c, t);
-                exit(1);
+        if (c > t * r)
+                violation(thr->thrid, c, t);
+}
+
+
+/*
+ * Parse "uniform:US", "exp:US" or "fixed:US".
+ */
+int parse_dwell(char *s, struct dwell *d)
+{
+        char *colon = strchr(s, ':');
+
+        if (!colon)
+                return -1;
+        *colon = '\0';
+        if (strcmp(s, "uniform") == 0)
+                d->kind = DWELL_UNIFORM;
+        else if (strcmp(s, "exp") == 0)
+                d->kind = DWELL_EXP;
+        else if (strcmp(s, "fixed") == 0)
+                d->kind = DWELL_FIXED;
+        else
+                return -1;
+        if (safe_atoi(colon + 1, &d->us) < 0 || d->us < 1)
+                return -1;
+        return 0;
+}
+
+const char *dwell_name(struct dwell *d)
+{
+        static char buf[2][32];
+        static int which;
+        char *kinds[] = { "uniform", "exp", "fixed" };
+
+        which = !which;
+        snprintf(buf[which], sizeof(buf[which]), "%s:%d", kinds[d->kind], d->us);
+        return buf[which];
+}
+
+/* Draw one dwell time, in microseconds */
+int draw_dwell(unsigned int *seed, struct dwell *d)
+{
+        double u;
+
+        switch (d->kind) {
+        case DWELL_EXP:
+                u = (rand_r(seed) + 1.0) / (RAND_MAX + 2.0);
+                return -log(u) * d->us;
+        case DWELL_FIXED:
+                return d->us;
+        default:
+                return rand_r(seed) % d->us;
         }
 }
 
+/*
+ * Draw a dwell time and sleep for it, scaled down by sleep_div.
+ */
+void kg_sleep(struct thread_info_struct *thr, struct dwell *d)
+{
+        int us = draw_dwell(&thr->rseed, d);
+
+        if (sleep_div > 0 && us / sleep_div > 0)
+                usleep(us / sleep_div);
+}
+
+int time_is_up(void)
+{
+        struct timespec now;
+
+        if (!duration)
+                return 0;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec > deadline.tv_sec ||
+                (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+}
+
+/*
+ * Should thr start another iteration? Teachers stay on duty
+ * for as long as any child is still around.
+ */
+int keep_going(struct thread_info_struct *thr, int iter)
+{
+        if (!thr->is_child && children_active > 0)
+                return 1;
+        return (nloops == 0 || iter < nloops) && !time_is_up();
+}
 
 /*
  * A single thread.
@@ -250,65 +752,516 @@ void *thread_start_fn(void *arg)
 {
         /* We know arg points to an instance of thread_info_struct */
         struct thread_info_struct *thr = arg;
-        char *nstr;
-
-        fprintf(stderr, "Thread %d of %d. START.\n", thr->thrid, thr->thrcnt);
-
-        nstr = thr->is_child ? "Child" : "Teacher";
-        for (;;) {
-                fprintf(stderr, "Thread %d [%s]: Entering.\n", thr->thrid, nstr);
-                if (thr->is_child)
-                        child_enter(thr);
-                else
+        uint64_t t0;
+        int iter;
+
+        kg_log(thr, 2, EV_START, thr->thrcnt, 0);
+
+        if (use_perf)
+                perf_counters_start(&thr->pc);
+
+        for (iter = 0; keep_going(thr, iter); iter++) {
+                thr->kg = thr->is_child ? pick_child_room(thr) : pick_teacher_room(thr, NULL);
+                kg_log(thr, 2, EV_ENTERING, thr->is_child, 0);
+                if (thr->is_child) {
+                        t0 = now_ns();
+                        if (child_enter(thr) != 0) {
+                                /* Gave up, try again after a while outside */
+                                kg_sleep(thr, &outside_dwell);
+                                continue;
+                        }
+                        hist_add(&thr->enter_wait, now_ns() - t0);
+                } else
                         teacher_enter(thr);
+                thr->entries++;
+                if (nrooms > 1)
+                        __sync_add_and_fetch(&thr->kg->admitted, 1);
 
-                fprintf(stderr, "Thread %d [%s]: Entered.\n", thr->thrid, nstr);
+                kg_log(thr, 2, EV_ENTERED, thr->is_child, 0);
 
-                pthread_mutex_lock(&thr->kg->mutex);
                 verify(thr);
-                pthread_mutex_unlock(&thr->kg->mutex);
 
                 /*
                  * We're inside the critical section,
                  * just sleep for a while.
                  */
 
-                /* usleep(rand_r(&thr->rseed) % 1000000 / (thr->is_child ? 10000 : 1)); */
-                usleep(rand_r(&thr->rseed) % 1000000);
+                kg_sleep(thr, &inside_dwell);
+                while (!thr->is_child && teacher_should_stay(thr)) {
+                        kg_sleep(thr, &inside_dwell);
+                        /* Without sleeps (-S 0), let the others catch up */
+                        sched_yield();
+                }
 
-                fprintf(stderr, "Thread %d [%s]: Exiting.\n", thr->thrid, nstr);
+                kg_log(thr, 2, EV_EXITING, thr->is_child, 0);
                 /* CRITICAL SECTION END */
 
                 if (thr->is_child)
                         child_exit(thr);
-                else
-                        teacher_exit(thr);
+                else {
+                        t0 = now_ns();
+                        /* With -Y, stay on duty until leaving is allowed */
+                        while (teacher_exit(thr) != 0)
+                                kg_sleep(thr, &inside_dwell);
+                        hist_add(&thr->exit_wait, now_ns() - t0);
+                }
 
-                fprintf(stderr, "Thread %d [%s]: Exited.\n", thr->thrid, nstr);
+                kg_log(thr, 2, EV_EXITED, thr->is_child, 0);
 
                 /* Sleep for a while before re-entering */
-                /* usleep(rand_r(&thr->rseed) % 100000 * (thr->is_child ? 100 : 1)); */
-                usleep(rand_r(&thr->rseed) % 100000);
+                kg_sleep(thr, &outside_dwell);
 
-                pthread_mutex_lock(&thr->kg->mutex);
                 verify(thr);
-                pthread_mutex_unlock(&thr->kg->mutex);
         }
-        fprintf(stderr, "Thread %d of %d. END.\n", thr->thrid, thr->thrcnt);
+        if (thr->is_child)
+                __sync_sub_and_fetch(&children_active, 1);
+
+        if (use_perf)
+                perf_counters_stop(&thr->pc);
+
+        kg_log(thr, 2, EV_END, thr->thrcnt, 0);
 
         return NULL;
 }
 
 
+/*
+ * Latency, throughput and occupancy summary, for real and simulated runs.
+ */
+void print_report(struct hist *enter_wait, struct hist *exit_wait,
+                  long entries, double elapsed, struct occupancy *o)
+{
+        static char *bins[OCC_BINS] = {
+                "no teachers", "0-10%", "10-20%", "20-30%", "30-40%", "40-50%",
+                "50-60%", "60-70%", "70-80%", "80-90%", "90-100%", "full"
+        };
+        int i;
+
+        printf("Dwell: inside %s us, outside %s us\n",
+               dwell_name(&inside_dwell), dwell_name(&outside_dwell));
+        hist_print_ns(stdout, "Child enter wait", enter_wait);
+        hist_print_ns(stdout, "Teacher exit wait", exit_wait);
+        printf("%ld entries, %.1f entries/s\n", entries, entries / elapsed);
+
+        if (o->total == 0)
+                return;
+        printf("Occupancy vc/(vt*ratio): mean vt %.2f, mean vc %.2f\n",
+               o->vt_sum / o->total, o->vc_sum / o->total);
+        for (i = 0; i < OCC_BINS; i++)
+                if (o->weight[i] > 0)
+                        printf("    %-12s %5.1f%%\n", bins[i],
+                               100.0 * o->weight[i] / o->total);
+}
+
+/*
+ * Discrete-event simulation (-V).
+ *
+ * Runs the same admission rules in a single thread against a
+ * virtual clock: every simulated thread is a small state machine and
+ * its next action sits in a min-heap ordered by (time, sequence).
+ * Blocked threads queue up FIFO and are admitted exactly as
+ * wake_waiters() would admit them. No real time passes, so millions
+ * of transitions take seconds, and a given seed always produces the
+ * same run; the checksum printed at the end makes that easy to check.
+ */
+enum sim_state { SIM_OUTSIDE, SIM_WAIT_ENTER, SIM_INSIDE, SIM_WAIT_EXIT, SIM_DONE };
+
+struct sim_thread {
+        int is_child;
+        enum sim_state state;
+        int iter;
+        unsigned int rseed;
+        uint64_t wait_start;    /* When it called child_enter/teacher_exit */
+};
+
+struct sim_event {
+        uint64_t t;     /* Virtual time, in microseconds */
+        uint64_t seq;   /* Tie breaker, keeps the order deterministic */
+        int thr;
+};
+
+struct sim {
+        struct sim_thread *thr;
+        int thrcnt, ratio, vt, vc;
+        int children_active;
+
+        struct sim_event *heap;
+        int nheap;
+        uint64_t seq, now;
+
+        /* FIFO queues of blocked thread ids */
+        int *child_q, child_head, child_tail;
+        int *teacher_q, teacher_head, teacher_tail;
+
+        long transitions, entries;
+        uint64_t checksum;
+
+        /* Waits are measured in virtual time, occupancy is time-weighted */
+        struct hist enter_wait, exit_wait;
+        struct occupancy occ;
+        uint64_t last_change;
+};
+
+static int sim_before(struct sim_event *a, struct sim_event *b)
+{
+        return a->t < b->t || (a->t == b->t && a->seq < b->seq);
+}
+
+void sim_push(struct sim *sm, int thrid, uint64_t t)
+{
+        struct sim_event ev, tmp;
+        int i = sm->nheap++;
+
+        ev.t = t;
+        ev.seq = sm->seq++;
+        ev.thr = thrid;
+        sm->heap[i] = ev;
+        while (i > 0 && sim_before(&sm->heap[i], &sm->heap[(i - 1) / 2])) {
+                tmp = sm->heap[i];
+                sm->heap[i] = sm->heap[(i - 1) / 2];
+                sm->heap[(i - 1) / 2] = tmp;
+                i = (i - 1) / 2;
+        }
+}
+
+struct sim_event sim_pop(struct sim *sm)
+{
+        struct sim_event top = sm->heap[0], tmp;
+        int i = 0, c;
+
+        sm->heap[0] = sm->heap[--sm->nheap];
+        for (;;) {
+                c = 2 * i + 1;
+                if (c >= sm->nheap)
+                        break;
+                if (c + 1 < sm->nheap && sim_before(&sm->heap[c + 1], &sm->heap[c]))
+                        c++;
+                if (!sim_before(&sm->heap[c], &sm->heap[i]))
+                        break;
+                tmp = sm->heap[i];
+                sm->heap[i] = sm->heap[c];
+                sm->heap[c] = tmp;
+                i = c;
+        }
+        return top;
+}
+
+/*
+ * Apply a transition, fold it into the checksum and check the ratio.
+ */
+void sim_transition(struct sim *sm, int thrid, int event)
+{
+        /* Teachers waiting out the last children do not count */
+        if (sm->children_active > 0)
+                occupancy_add(&sm->occ, sm->vt, sm->vc, sm->ratio,
+                              sm->now - sm->last_change);
+        sm->last_change = sm->now;
+
+        switch (event) {
+        case EV_CHILD_ENTER:
+                hist_add(&sm->enter_wait,
+                         (sm->now - sm->thr[thrid].wait_start) * 1000);
+                sm->entries++;
+                break;
+        case EV_TEACHER_ENTER:
+                sm->entries++;
+                break;
+        case EV_TEACHER_EXIT:
+                hist_add(&sm->exit_wait,
+                         (sm->now - sm->thr[thrid].wait_start) * 1000);
+                break;
+        }
+
+        switch (event) {
+        case EV_CHILD_ENTER:   sm->vc++; break;
+        case EV_CHILD_EXIT:    sm->vc--; break;
+        case EV_TEACHER_ENTER: sm->vt++; break;
+        case EV_TEACHER_EXIT:  sm->vt--; break;
+        }
+        sm->transitions++;
+
+        /* FNV-1a over (time, thread, event) */
+        sm->checksum = (sm->checksum ^ sm->now) * 0x100000001b3ULL;
+        sm->checksum = (sm->checksum ^ thrid) * 0x100000001b3ULL;
+        sm->checksum = (sm->checksum ^ event) * 0x100000001b3ULL;
+
+        if (sm->vc > sm->vt * sm->ratio)
+                violation(thrid, sm->vc, sm->vt);
+}
+
+/* Schedule the next action of a thread that just got in or out */
+void sim_schedule(struct sim *sm, int thrid)
+{
+        struct sim_thread *st = &sm->thr[thrid];
+
+        if (st->state == SIM_INSIDE) {
+                sim_push(sm, thrid, sm->now + draw_dwell(&st->rseed, &inside_dwell));
+                return;
+        }
+
+        /* Back outside: one more iteration done */
+        st->iter++;
+        if (st->is_child && nloops && st->iter >= nloops) {
+                st->state = SIM_DONE;
+                sm->children_active--;
+                return;
+        }
+        if (!st->is_child && sm->children_active == 0 && nloops && st->iter >= nloops) {
+                st->state = SIM_DONE;
+                return;
+        }
+        sim_push(sm, thrid, sm->now + draw_dwell(&st->rseed, &outside_dwell));
+}
+
+/* Admit whoever can go now, children first, as wake_waiters() does */
+void sim_wake(struct sim *sm)
+{
+        int id;
+
+        while (sm->child_head != sm->child_tail &&
+               sm->vc + 1 <= sm->vt * sm->ratio) {
+                id = sm->child_q[sm->child_head++ % sm->thrcnt];
+                sm->thr[id].state = SIM_INSIDE;
+                sim_transition(sm, id, EV_CHILD_ENTER);
+                sim_schedule(sm, id);
+        }
+        while (sm->teacher_head != sm->teacher_tail &&
+               (sm->vt - 1) * sm->ratio >= sm->vc) {
+                id = sm->teacher_q[sm->teacher_head++ % sm->thrcnt];
+                sm->thr[id].state = SIM_OUTSIDE;
+                sim_transition(sm, id, EV_TEACHER_EXIT);
+                sim_schedule(sm, id);
+        }
+}
+
+void sim_step(struct sim *sm, int id)
+{
+        struct sim_thread *st = &sm->thr[id];
+
+        st->wait_start = sm->now;
+        if (st->state == SIM_OUTSIDE) {
+                if (!st->is_child) {
+                        st->state = SIM_INSIDE;
+                        sim_transition(sm, id, EV_TEACHER_ENTER);
+                        sim_schedule(sm, id);
+                        sim_wake(sm);
+                } else if (sm->vc + 1 <= sm->vt * sm->ratio &&
+                           sm->child_head == sm->child_tail) {
+                        st->state = SIM_INSIDE;
+                        sim_transition(sm, id, EV_CHILD_ENTER);
+                        sim_schedule(sm, id);
+                } else {
+                        st->state = SIM_WAIT_ENTER;
+                        sm->child_q[sm->child_tail++ % sm->thrcnt] = id;
+                }
+        } else if (st->state == SIM_INSIDE) {
+                if (st->is_child) {
+                        st->state = SIM_OUTSIDE;
+                        sim_transition(sm, id, EV_CHILD_EXIT);
+                        sim_schedule(sm, id);
+                        sim_wake(sm);
+                } else if ((sm->vt - 1) * sm->ratio >= sm->vc &&
+                           sm->teacher_head == sm->teacher_tail) {
+                        st->state = SIM_OUTSIDE;
+                        sim_transition(sm, id, EV_TEACHER_EXIT);
+                        sim_schedule(sm, id);
+                } else {
+                        st->state = SIM_WAIT_EXIT;
+                        sm->teacher_q[sm->teacher_tail++ % sm->thrcnt] = id;
+                }
+        }
+}
+
+void run_simulation(int thrcnt, int chldcnt, int ratio)
+{
+        struct sim sm;
+        struct sim_event ev;
+        struct timespec ts_start, ts_end;
+        double elapsed;
+        int i;
+
+        memset(&sm, 0, sizeof(sm));
+        sm.thrcnt = thrcnt;
+        sm.ratio = ratio;
+        sm.children_active = chldcnt;
+        sm.checksum = 0xcbf29ce484222325ULL;
+        hist_init(&sm.enter_wait);
+        hist_init(&sm.exit_wait);
+        sm.thr = safe_malloc(thrcnt * sizeof(*sm.thr));
+        sm.heap = safe_malloc(thrcnt * sizeof(*sm.heap));
+        sm.child_q = safe_malloc(thrcnt * sizeof(*sm.child_q));
+        sm.teacher_q = safe_malloc(thrcnt * sizeof(*sm.teacher_q));
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        deadline = ts_start;
+        deadline.tv_sec += duration;
+        for (i = 0; i < thrcnt; i++) {
+                sm.thr[i].is_child = (i < chldcnt);
+                sm.thr[i].state = SIM_OUTSIDE;
+                sm.thr[i].iter = 0;
+                sm.thr[i].rseed = rand();
+                sim_push(&sm, i, 0);
+        }
+
+        while (sm.nheap > 0) {
+                ev = sim_pop(&sm);
+                if (duration && ev.t >= (uint64_t)duration * 1000000)
+                        break;
+                sm.now = ev.t;
+                sim_step(&sm, ev.thr);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+        elapsed = (ts_end.tv_sec - ts_start.tv_sec) +
+                (ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+
+        if (sm.nheap == 0 && (sm.child_head != sm.child_tail ||
+                              sm.teacher_head != sm.teacher_tail)) {
+                printf("Deadlock at %.6fs virtual time: %d children and %d teachers "
+                       "waiting, nobody left to wake them.\n", sm.now / 1e6,
+                       sm.child_tail - sm.child_head,
+                       sm.teacher_tail - sm.teacher_head);
+                exit(1);
+        }
+
+        printf("OK.\n");
+        printf("Admission: simulated, virtual time\n");
+        printf("%ld transitions in %.3fs virtual, %.3fs wall, %.1f transitions/s\n",
+               sm.transitions, sm.now / 1e6, elapsed, sm.transitions / elapsed);
+        printf("Checksum: %016llx\n", (unsigned long long)sm.checksum);
+        print_report(&sm.enter_wait, &sm.exit_wait, sm.entries,
+                     sm.now / 1e6, &sm.occ);
+}
+
+void kg_init(struct kgarten_struct *kg, int ratio)
+{
+        int ret;
+
+        kg->vt = kg->vc = 0;
+        kg->ratio = ratio;
+
+        ret = pthread_mutex_init(&kg->mutex, NULL);
+        if (ret) {
+                perror_pthread(ret, "pthread_mutex_init");
+                exit(1);
+        }
+
+        gate_cfg.ratio = ratio;
+        if (gate_init(&kg->gate, &gate_cfg) < 0) {
+                perror("gate_init");
+                exit(1);
+        }
+        kg->admitted = 0;
+}
+
 int main(int argc, char *argv[])
 {
-        int i, ret, thrcnt, chldcnt, ratio;
+        int i, ret, thrcnt, chldcnt, ratio, opt;
         struct thread_info_struct *thr;
-        struct kgarten_struct *kg;
+        char label[64];
+        struct timespec ts_start, ts_end;
+        long transitions, signals, wakeups, futile_wakeups, timeouts, entries, busy;
+        struct hist enter_wait, exit_wait;
+        pthread_t sampler, auditor;
+        struct trace_header hdr;
+        unsigned long logged, dropped;
+        double elapsed;
+        unsigned int seed = time(NULL);
 
         /*
          * Parse the command line
          */
+        while ((opt = getopt(argc, argv, "pLVYn:d:s:S:I:O:R:F:T:A:G:t:v:")) != -1) {
+                switch (opt) {
+                case 'p':
+                        use_perf = 1;
+                        break;
+                case 'L':
+                        gate_cfg.lockfree = 1;
+                        break;
+                case 'V':
+                        simulate = 1;
+                        break;
+                case 'Y':
+                        try_mode = 1;
+                        break;
+                case 'd':
+                        if (safe_atoi(optarg, &duration) < 0 || duration < 0) {
+                                fprintf(stderr, "`%s' is not valid for `secs'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 's':
+                        seed = strtoul(optarg, NULL, 0);
+                        break;
+                case 'S':
+                        if (safe_atoi(optarg, &sleep_div) < 0 || sleep_div < 0) {
+                                fprintf(stderr, "`%s' is not valid for `div'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'I':
+                case 'O':
+                        if (parse_dwell(optarg, opt == 'I' ? &inside_dwell : &outside_dwell) < 0) {
+                                fprintf(stderr, "`%s' is not a valid dwell time distribution\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'R':
+                        if (safe_atoi(optarg, &nrooms) < 0 || nrooms < 1) {
+                                fprintf(stderr, "`%s' is not valid for `rooms'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'F':
+                        if (gate_parse_policy(optarg, &gate_cfg) < 0) {
+                                fprintf(stderr, "`%s' is not a valid fairness policy\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'T':
+                        if (safe_atoi(optarg, &child_timeout_us) < 0 || child_timeout_us < 0) {
+                                fprintf(stderr, "`%s' is not valid for `ms'\n", optarg);
+                                exit(1);
+                        }
+                        child_timeout_us *= 1000;
+                        break;
+                case 'A':
+                        if (safe_atoi(optarg, &audit_hz) < 0 || audit_hz < 1 ||
+                            audit_hz > 1000000) {
+                                fprintf(stderr, "`%s' is not valid for `hz'\n", optarg);
+                                exit(1);
+                        }
+                        inline_verify = 0;
+                        break;
+                case 'G':
+                        if (safe_atoi(optarg, &group) < 0 || group < 1) {
+                                fprintf(stderr, "`%s' is not valid for `size'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 't':
+                        trace_prefix = optarg;
+                        break;
+                case 'v':
+                        if (safe_atoi(optarg, &verbosity) < 0 || verbosity < 0) {
+                                fprintf(stderr, "`%s' is not valid for `level'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'n':
+                        if (safe_atoi(optarg, &nloops) < 0 || nloops < 0) {
+                                fprintf(stderr, "`%s' is not valid for `loops'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        argv += optind - 1;
+        argc -= optind - 1;
+
         if (argc != 4)
                 usage(argv[0]);
         if (safe_atoi(argv[1], &thrcnt) < 0 || thrcnt <= 0) {
@@ -325,41 +1278,107 @@ int main(int argc, char *argv[])
         }
 
 
+        if ((gate_cfg.lockfree || simulate) && gate_cfg.policy != GATE_BARGING) {
+                fprintf(stderr, "Fairness policies apply to the threaded mutex mode only\n");
+                exit(1);
+        }
+        if (simulate && (try_mode || group > 1)) {
+                fprintf(stderr, "The simulation only models single children that wait\n");
+                exit(1);
+        }
+        if (try_mode && child_timeout_us) {
+                fprintf(stderr, "-T has no effect with -Y, nobody waits\n");
+                exit(1);
+        }
+        if (chldcnt > 0 && group > (thrcnt - chldcnt) * ratio) {
+                fprintf(stderr, "Not enough teachers for a group of %d children\n", group);
+                exit(1);
+        }
+        if (simulate && trace_prefix) {
+                fprintf(stderr, "Only real threads can be traced\n");
+                exit(1);
+        }
+        if (simulate && nrooms > 1) {
+                fprintf(stderr, "The simulation only models a single room\n");
+                exit(1);
+        }
+        if (simulate && !nloops && !duration) {
+                fprintf(stderr, "A simulation needs -n or -d to know when to stop\n");
+                exit(1);
+        }
+
         /*
          * Initialize kindergarten and random number generator
          */
-        srand(time(NULL));
-
-        kg = safe_malloc(sizeof(*kg));
-        kg->vt = kg->vc = 0;
-        kg->ratio = ratio;
+        srand(seed);
+        printf("Seed: %u\n", seed);
 
-        ret = pthread_mutex_init(&kg->mutex, NULL);
-        if (ret) {
-                perror_pthread(ret, "pthread_mutex_init");
-                exit(1);
+        if (simulate) {
+                run_simulation(thrcnt, chldcnt, ratio);
+                return 0;
         }
-        
-        /* Initializing my kgarten additions */
-        ret = pthread_cond_init(&kg->cond, NULL);
-        if (ret) {
-                perror_pthread(ret, "pthread_cond_init");
+
+        rooms = aligned_alloc(64, nrooms * sizeof(*rooms));
+        if (!rooms) {
+                fprintf(stderr, "Out of memory, failed to allocate %d rooms\n", nrooms);
                 exit(1);
         }
-        
-        
+        for (i = 0; i < nrooms; i++)
+                kg_init(&rooms[i], ratio);
+        children_active = chldcnt;
+
         /*
          * Create threads
          */
         thr = safe_malloc(thrcnt * sizeof(*thr));
 
+        if (verbosity > 0 && log_init(thrcnt, 2, kg_format_log) < 0) {
+                fprintf(stderr, "Failed to set up the log rings\n");
+                exit(1);
+        }
+
+        ret = pthread_create(&sampler, NULL, sampler_fn, NULL);
+        if (ret) {
+                perror_pthread(ret, "pthread_create");
+                exit(1);
+        }
+        if (audit_hz) {
+                ret = pthread_create(&auditor, NULL, auditor_fn, NULL);
+                if (ret) {
+                        perror_pthread(ret, "pthread_create");
+                        exit(1);
+                }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &ts_start);
+        deadline = ts_start;
+        deadline.tv_sec += duration;
         for (i = 0; i < thrcnt; i++) {
                 /* Initialize per-thread structure */
-                thr[i].kg = kg;
+                thr[i].kg = &rooms[0];
                 thr[i].thrid = i;
                 thr[i].thrcnt = thrcnt;
                 thr[i].is_child = (i < chldcnt);
                 thr[i].rseed = rand();
+                thr[i].room_seed = rand();
+                if (gate_waiter_init(&thr[i].gw) < 0) {
+                        perror("gate_waiter_init");
+                        exit(1);
+                }
+                if (trace_prefix) {
+                        memset(&hdr, 0, sizeof(hdr));
+                        hdr.magic = TRACE_MAGIC;
+                        hdr.thrid = i;
+                        hdr.thrcnt = thrcnt;
+                        hdr.ratio = ratio;
+                        hdr.nrooms = nrooms;
+                        hdr.group = group;
+                        if (trace_open(&thr[i].tb, trace_prefix, &hdr) < 0)
+                                exit(1);
+                }
+                thr[i].transitions = thr[i].entries = thr[i].busy = 0;
+                hist_init(&thr[i].enter_wait);
+                hist_init(&thr[i].exit_wait);
 
                 /* Spawn new thread */
                 ret = pthread_create(&thr[i].tid, NULL, thread_start_fn, &thr[i]);
@@ -380,7 +1399,75 @@ int main(int argc, char *argv[])
                 }
         }
 
+        clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+        if (trace_prefix)
+                for (i = 0; i < thrcnt; i++)
+                        trace_close(&thr[i].tb);
+
+        watchers_stop = 1;
+        pthread_join(sampler, NULL);
+        if (audit_hz)
+                pthread_join(auditor, NULL);
+
+        if (verbosity > 0)
+                log_shutdown(&logged, &dropped);
+
         printf("OK.\n");
 
+        transitions = signals = wakeups = futile_wakeups = timeouts = entries = busy = 0;
+        hist_init(&enter_wait);
+        hist_init(&exit_wait);
+        for (i = 0; i < thrcnt; i++) {
+                hist_merge(&enter_wait, &thr[i].enter_wait);
+                hist_merge(&exit_wait, &thr[i].exit_wait);
+                entries += thr[i].entries;
+                transitions += thr[i].transitions;
+                signals += thr[i].gw.signals;
+                wakeups += thr[i].gw.wakeups;
+                futile_wakeups += thr[i].gw.futile_wakeups;
+                timeouts += thr[i].gw.timeouts;
+                busy += thr[i].busy;
+        }
+        elapsed = (ts_end.tv_sec - ts_start.tv_sec) +
+                (ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+
+        if (gate_cfg.lockfree)
+                printf("Admission: lock-free\n");
+        else
+                printf("Admission: mutex, %s\n", gate_policy_name(&gate_cfg));
+        if (nrooms > 1) {
+                printf("Rooms: %d\n", nrooms);
+                for (i = 0; i < nrooms; i++)
+                        printf("    room %d: %ld entries\n", i, rooms[i].admitted);
+        }
+        printf("%ld transitions in %.3fs, %.1f transitions/s\n",
+               transitions, elapsed, transitions / elapsed);
+        printf("%ld %s, %ld wakeups (%ld futile), "
+               "%.3f wakeups per transition\n", signals,
+               gate_cfg.lockfree ? "futex wakes" : "signals", wakeups, futile_wakeups,
+               transitions ? (double)wakeups / transitions : 0.0);
+        if (child_timeout_us)
+                printf("%ld child visits gave up after %d ms\n", timeouts,
+                       child_timeout_us / 1000);
+        if (try_mode)
+                printf("%ld attempts found the gate busy\n", busy);
+        if (group > 1)
+                printf("Children in groups of %d\n", group);
+        if (audit_hz)
+                printf("Checks: auditor only, %ld snapshots at %d Hz\n", audits, audit_hz);
+        else
+                printf("Checks: inline\n");
+        print_report(&enter_wait, &exit_wait, entries, elapsed, &occ);
+        if (verbosity > 0)
+                printf("Log: %lu records written, %lu dropped\n", logged, dropped);
+
+        if (use_perf)
+                for (i = 0; i < thrcnt; i++) {
+                        snprintf(label, sizeof(label), "Thread %d [%s]",
+                                thr[i].thrid, thr[i].is_child ? "Child" : "Teacher");
+                        perf_counters_report(stdout, label, &thr[i].pc);
+                }
+
         return 0;
 }
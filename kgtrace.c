@@ -0,0 +1,326 @@
+/*
+ * kgtrace.c
+ *
+ * Offline analyzer for kgarten -t traces.
+ *
+ * Merges the per-thread trace files into one timeline, replays
+ * the teacher and child counts of every room, and reports ratio
+ * violations and long waits (starvation). Files are streamed with
+ * a bounded buffer each, so traces of any size can be analyzed.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "trace-lib.h"
+#include "hist-lib.h"
+
+/* How many violations and long waits to print in full */
+#define REPORT_MAX      10
+
+/* One input file and its next record */
+struct input {
+        struct trace_reader tr;
+        struct trace_rec rec;
+};
+
+/*
+ * Replayed state of a room. A transition happened somewhere between
+ * its request and done records, so the counts are replayed on the
+ * safe side: children count from ENTERED until EXIT, teachers from
+ * ENTER until EXITED. The replayed vc is never above, and vt never
+ * below, the real one; any violation found is a real violation.
+ */
+struct room {
+        int vt, vc;
+};
+
+/* Per thread: when its current wait started, 0 if not waiting */
+struct waiter {
+        uint64_t since;
+        int room, is_child;
+};
+
+struct long_wait {
+        uint64_t start, ns;
+        int thrid, room, is_child;
+};
+
+static char *event_names[TR_NR_EVENTS] = {
+        "CHILD ENTER", "CHILD ENTERED", "CHILD EXIT", "CHILD EXITED",
+        "TEACHER ENTER", "TEACHER ENTERED", "TEACHER EXIT", "TEACHER EXITED",
+        "GAVE UP"
+};
+
+struct input *inputs;
+int ninputs;
+
+/* Min-heap of input indices, by (ts, thrid) */
+int *heap;
+int nheap;
+
+int show_timeline = 0;
+uint64_t wait_threshold = 1000000000;   /* -w, in ns */
+
+void *safe_malloc(size_t size)
+{
+        void *p;
+
+        if ((p = malloc(size)) == NULL) {
+                fprintf(stderr, "Out of memory, failed to allocate %zd bytes\n",
+                        size);
+                exit(1);
+        }
+
+        return p;
+}
+
+void usage(char *argv0)
+{
+        fprintf(stderr, "Usage: %s [-t] [-w ms] prefix\n\n"
+                "Analyze the trace that kgarten -t prefix wrote into\n"
+                "prefix.0, prefix.1, ...\n\n"
+                "Options:\n"
+                "    -t: Print the replayed timeline, one line per record.\n"
+                "    -w ms: Report waits longer than this (default 1000).\n\n",
+                argv0);
+        exit(1);
+}
+
+static int before(int a, int b)
+{
+        struct trace_rec *ra = &inputs[a].rec, *rb = &inputs[b].rec;
+
+        return ra->ts < rb->ts || (ra->ts == rb->ts && ra->thrid < rb->thrid);
+}
+
+static void heap_down(int i)
+{
+        int c, tmp;
+
+        for (;;) {
+                c = 2 * i + 1;
+                if (c >= nheap)
+                        break;
+                if (c + 1 < nheap && before(heap[c + 1], heap[c]))
+                        c++;
+                if (!before(heap[c], heap[i]))
+                        break;
+                tmp = heap[i];
+                heap[i] = heap[c];
+                heap[c] = tmp;
+                i = c;
+        }
+}
+
+/* Next record in time order across all files, 0 when all are done */
+int next_record(struct trace_rec *rec)
+{
+        struct input *in;
+
+        if (nheap == 0)
+                return 0;
+        in = &inputs[heap[0]];
+        *rec = in->rec;
+        if (!trace_read(&in->tr, &in->rec))
+                heap[0] = heap[--nheap];
+        heap_down(0);
+        return 1;
+}
+
+/* Keep the REPORT_MAX longest waits, longest first */
+void note_long_wait(struct long_wait *top, int *ntop, struct long_wait *w)
+{
+        int i;
+
+        if (*ntop == REPORT_MAX && w->ns <= top[REPORT_MAX - 1].ns)
+                return;
+        if (*ntop < REPORT_MAX)
+                (*ntop)++;
+        for (i = *ntop - 1; i > 0 && top[i - 1].ns < w->ns; i--)
+                top[i] = top[i - 1];
+        top[i] = *w;
+}
+
+int main(int argc, char *argv[])
+{
+        struct trace_header hdr;
+        struct trace_reader inputs0;
+        struct trace_rec rec;
+        struct room *rooms;
+        struct waiter *waiting;
+        struct hist enter_wait, exit_wait;
+        struct long_wait top[REPORT_MAX], lw;
+        char path[4096];
+        unsigned long nrecs = 0, violations = 0, nlong = 0, stuck = 0;
+        uint64_t t_first = 0, t_last = 0;
+        int i, opt, ntop = 0, ms;
+        struct room *r;
+        struct waiter *w;
+
+        while ((opt = getopt(argc, argv, "tw:")) != -1) {
+                switch (opt) {
+                case 't':
+                        show_timeline = 1;
+                        break;
+                case 'w':
+                        ms = atoi(optarg);
+                        if (ms <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `ms'\n", optarg);
+                                exit(1);
+                        }
+                        wait_threshold = (uint64_t)ms * 1000000;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (argc - optind != 1)
+                usage(argv[0]);
+
+        /*
+         * The header of prefix.0 says how many files to expect
+         */
+        snprintf(path, sizeof(path), "%s.0", argv[optind]);
+        if (trace_reader_open(&inputs0, path) < 0) {
+                perror(path);
+                exit(1);
+        }
+        hdr = inputs0.hdr;
+        ninputs = hdr.thrcnt;
+        if (hdr.group < 1)
+                hdr.group = 1;
+        inputs = safe_malloc(ninputs * sizeof(*inputs));
+        inputs[0].tr = inputs0;
+        heap = safe_malloc(ninputs * sizeof(*heap));
+        for (i = 1; i < ninputs; i++) {
+                snprintf(path, sizeof(path), "%s.%d", argv[optind], i);
+                if (trace_reader_open(&inputs[i].tr, path) < 0) {
+                        perror(path);
+                        exit(1);
+                }
+        }
+        for (i = 0; i < ninputs; i++)
+                if (trace_read(&inputs[i].tr, &inputs[i].rec))
+                        heap[nheap++] = i;
+        for (i = nheap / 2 - 1; i >= 0; i--)
+                heap_down(i);
+
+        rooms = safe_malloc(hdr.nrooms * sizeof(*rooms));
+        memset(rooms, 0, hdr.nrooms * sizeof(*rooms));
+        waiting = safe_malloc(ninputs * sizeof(*waiting));
+        memset(waiting, 0, ninputs * sizeof(*waiting));
+        hist_init(&enter_wait);
+        hist_init(&exit_wait);
+
+        printf("Trace: %d threads, %d rooms, ratio %d, children in groups of %d\n",
+               hdr.thrcnt, hdr.nrooms, hdr.ratio, hdr.group);
+
+        /*
+         * Replay
+         */
+        while (next_record(&rec)) {
+                if (rec.room >= hdr.nrooms || rec.thrid >= (unsigned)ninputs ||
+                    rec.event >= TR_NR_EVENTS) {
+                        fprintf(stderr, "Corrupt record at %llu, stopping\n",
+                                (unsigned long long)rec.ts);
+                        break;
+                }
+                if (nrecs++ == 0)
+                        t_first = rec.ts;
+                t_last = rec.ts;
+                r = &rooms[rec.room];
+                w = &waiting[rec.thrid];
+
+                switch (rec.event) {
+                case TR_CHILD_ENTER:
+                case TR_TEACHER_EXIT:
+                        w->since = rec.ts;
+                        w->room = rec.room;
+                        w->is_child = (rec.event == TR_CHILD_ENTER);
+                        break;
+                case TR_CHILD_ENTERED:
+                case TR_TEACHER_EXITED:
+                case TR_GAVE_UP:
+                        if (rec.event == TR_CHILD_ENTERED)
+                                r->vc += hdr.group;
+                        else if (rec.event == TR_TEACHER_EXITED)
+                                r->vt--;
+                        if (!w->since)
+                                break;
+                        hist_add(w->is_child ? &enter_wait : &exit_wait, rec.ts - w->since);
+                        if (rec.ts - w->since > wait_threshold) {
+                                nlong++;
+                                lw.start = w->since;
+                                lw.ns = rec.ts - w->since;
+                                lw.thrid = rec.thrid;
+                                lw.room = w->room;
+                                lw.is_child = w->is_child;
+                                note_long_wait(top, &ntop, &lw);
+                        }
+                        w->since = 0;
+                        break;
+                case TR_CHILD_EXIT:
+                        r->vc -= hdr.group;
+                        break;
+                case TR_TEACHER_ENTER:
+                        r->vt++;
+                        break;
+                }
+
+                if (show_timeline)
+                        printf("%.9f room %d thread %d %-15s vt=%d vc=%d\n",
+                               (rec.ts - t_first) / 1e9, rec.room, rec.thrid,
+                               event_names[rec.event], r->vt, r->vc);
+
+                if (r->vc > r->vt * hdr.ratio) {
+                        if (violations++ < REPORT_MAX)
+                                printf("*** Violation at %.9fs: room %d has %d teachers "
+                                       "for %d children (thread %d, %s)\n",
+                                       (rec.ts - t_first) / 1e9, rec.room, r->vt, r->vc,
+                                       rec.thrid, event_names[rec.event]);
+                }
+        }
+
+        /* Threads still waiting when the trace ends */
+        for (i = 0; i < ninputs; i++) {
+                w = &waiting[i];
+                if (!w->since)
+                        continue;
+                stuck++;
+                if (t_last - w->since > wait_threshold) {
+                        nlong++;
+                        lw.start = w->since;
+                        lw.ns = t_last - w->since;
+                        lw.thrid = i;
+                        lw.room = w->room;
+                        lw.is_child = w->is_child;
+                        note_long_wait(top, &ntop, &lw);
+                }
+        }
+
+        printf("%lu records over %.3fs\n", nrecs, (t_last - t_first) / 1e9);
+        hist_print_ns(stdout, "Child enter wait", &enter_wait);
+        hist_print_ns(stdout, "Teacher exit wait", &exit_wait);
+        printf("%lu waits longer than %llu ms, %lu threads still waiting at the end\n",
+               nlong, (unsigned long long)(wait_threshold / 1000000), stuck);
+        for (i = 0; i < ntop; i++)
+                printf("    %s %d in room %d waited %.3fs from %.9fs\n",
+                       top[i].is_child ? "child" : "teacher", top[i].thrid,
+                       top[i].room, top[i].ns / 1e9, (top[i].start - t_first) / 1e9);
+
+        for (i = 0; i < ninputs; i++)
+                trace_reader_close(&inputs[i].tr);
+
+        if (violations) {
+                printf("%lu ratio violations.\n", violations);
+                return 1;
+        }
+        printf("No ratio violations.\n");
+        return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * log-lib.c
+ *
+ * Asynchronous binary logging: every thread appends fixed-size
+ * records to its own lock-free single-producer/single-consumer ring,
+ * and a background drainer thread formats and writes them in batches.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "log-lib.h"
+
+/* Records per ring, must be a power of two */
+#define LOG_RING_SIZE 1024
+
+/* Drainer output buffer, flushed with a single write() */
+#define LOG_BATCH_BYTES (64 * 1024)
+
+/*
+ * head is only written by the producer, tail only by the drainer;
+ * keep them on separate cache lines so they do not ping-pong.
+ */
+struct log_ring {
+	volatile unsigned long head __attribute__((aligned(64)));
+	volatile unsigned long tail __attribute__((aligned(64)));
+	unsigned long dropped;	/* Producer only: records lost to a full ring */
+	struct log_rec recs[LOG_RING_SIZE];
+};
+
+static struct log_ring *rings;
+static int nr_rings;
+static int out_fd;
+static log_format_fn formatter;
+
+static pthread_t drainer;
+static volatile int stopping;
+static unsigned long nr_written;
+
+/* Scratch space for one drain pass, sorted by timestamp before output */
+static struct log_rec *batch;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Append a record to the ring of the calling thread.
+ * Never blocks: if the drainer has fallen behind, the record is
+ * dropped and counted instead.
+ */
+void log_event(int ring, int event, int a, int b)
+{
+	struct log_ring *r = &rings[ring];
+	struct log_rec *rec;
+	unsigned long h;
+
+	h = r->head;
+	if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+
+	rec = &r->recs[h & (LOG_RING_SIZE - 1)];
+	rec->ts = now_ns();
+	rec->thrid = ring;
+	rec->event = event;
+	rec->a = a;
+	rec->b = b;
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+static void write_out(const char *buf, size_t count)
+{
+	ssize_t ret;
+
+	while (count > 0) {
+		ret = write(out_fd, buf, count);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("log drainer: write");
+			return;
+		}
+		buf += ret;
+		count -= ret;
+	}
+}
+
+static int cmp_recs(const void *a, const void *b)
+{
+	const struct log_rec *ra = a, *rb = b;
+
+	return (ra->ts > rb->ts) - (ra->ts < rb->ts);
+}
+
+/*
+ * Move everything currently in the rings to the output.
+ * Returns the number of records drained.
+ */
+static int drain_once(void)
+{
+	static char out[LOG_BATCH_BYTES];
+	struct log_ring *r;
+	unsigned long h, t;
+	int i, n = 0, len = 0;
+
+	for (i = 0; i < nr_rings; i++) {
+		r = &rings[i];
+		t = r->tail;
+		h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (; t != h; t++)
+			batch[n++] = r->recs[t & (LOG_RING_SIZE - 1)];
+		__atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+	}
+
+	/* Interleave the threads in the order things actually happened */
+	qsort(batch, n, sizeof(*batch), cmp_recs);
+
+	for (i = 0; i < n; i++) {
+		if (LOG_BATCH_BYTES - len < 256) {
+			write_out(out, len);
+			len = 0;
+		}
+		len += formatter(out + len, LOG_BATCH_BYTES - len, &batch[i]);
+	}
+	if (len > 0)
+		write_out(out, len);
+
+	nr_written += n;
+	return n;
+}
+
+static void *drainer_fn(void *arg)
+{
+	while (!stopping) {
+		if (drain_once() == 0)
+			usleep(1000);
+	}
+
+	/* The producers are gone, flush what is left */
+	drain_once();
+	return NULL;
+}
+
+/*
+ * Set up one ring per producer thread and start the drainer.
+ * Records are turned into text by format() and written to fd.
+ */
+int log_init(int nrings, int fd, log_format_fn format)
+{
+	int ret;
+
+	rings = aligned_alloc(64, nrings * sizeof(*rings));
+	batch = malloc((size_t)nrings * LOG_RING_SIZE * sizeof(*batch));
+	if (!rings || !batch)
+		return -1;
+	memset(rings, 0, nrings * sizeof(*rings));
+
+	nr_rings = nrings;
+	out_fd = fd;
+	formatter = format;
+	stopping = 0;
+	nr_written = 0;
+
+	ret = pthread_create(&drainer, NULL, drainer_fn, NULL);
+	if (ret) {
+		errno = ret;
+		perror("log_init: pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Stop the drainer after it has written out what the rings hold,
+ * but leave them in place, so producers that are still running only
+ * fill them up. For bailing out in the middle of a run; call it from
+ * one thread only, and not together with log_shutdown().
+ */
+void log_flush(void)
+{
+	if (!rings)
+		return;
+	stopping = 1;
+	pthread_join(drainer, NULL);
+}
+
+/*
+ * Stop the drainer after it has written everything out.
+ * Call only after all producers are done.
+ */
+void log_shutdown(unsigned long *written, unsigned long *dropped)
+{
+	int i;
+
+	stopping = 1;
+	pthread_join(drainer, NULL);
+
+	*written = nr_written;
+	*dropped = 0;
+	for (i = 0; i < nr_rings; i++)
+		*dropped += rings[i].dropped;
+
+	free(batch);
+	free(rings);
+	rings = NULL;
+}
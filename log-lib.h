@@ -0,0 +1,36 @@
+/*
+ * log-lib.h
+ *
+ * Asynchronous binary logging: every thread appends fixed-size
+ * records to its own lock-free single-producer/single-consumer ring,
+ * and a background drainer thread formats and writes them in batches.
+ *
+ */
+
+#ifndef LOG_LIB_H__
+#define LOG_LIB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* One binary log record */
+struct log_rec {
+	uint64_t ts;	/* CLOCK_MONOTONIC, in nanoseconds */
+	int thrid;
+	int event;	/* Application-defined event code */
+	int a, b;	/* Event arguments */
+};
+
+/*
+ * Turns a record into text, returns the number of bytes written
+ * into buf (at most len, newline included).
+ */
+typedef int (*log_format_fn)(char *buf, size_t len, const struct log_rec *rec);
+
+/* Function prototypes */
+int log_init(int nrings, int fd, log_format_fn format);
+void log_event(int ring, int event, int a, int b);
+void log_flush(void);
+void log_shutdown(unsigned long *written, unsigned long *dropped);
+
+#endif /* LOG_LIB_H__ */
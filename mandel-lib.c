@@ -12,6 +12,10 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "mandel-lib.h"
 
@@ -26,7 +30,7 @@
 
 
 // whole colortable, filled by maketable()
-static int initialized=0;
+static volatile int initialized=0;
 static unsigned char colortable[254][3];
 
 // the 6 value iterations en the xterm color cube
@@ -99,8 +103,11 @@ static unsigned char rgb2xterm(unsigned char* rgb)
 	unsigned char c, best_match=0;
 	double d, smallest_distance;
 
-	if(!initialized)
+	if(!initialized) {
 		maketable();
+		__sync_synchronize();
+		initialized = 1;
+	}
 
 	smallest_distance = 10000000000.0;
 	
@@ -424,18 +431,64 @@ int mandel_iterations_at_point(double x, double y, int max)
  */
 unsigned char xterm_color(int color_val)
 {
+	static unsigned char cache[256];
+	static volatile int cached = 0;
 	unsigned char rgb[3];
+	int i;
+
+	/*
+	 * The nearest xterm color takes a search of the whole table,
+	 * so it is done once for every palette entry. Threads that
+	 * race here all store the same values.
+	 */
+	if (!cached) {
+		for (i = 0; i < 256; i++) {
+			rgb[0] = 255.0 * mandel256[i].red;
+			rgb[1] = 255.0 * mandel256[i].green;
+			rgb[2] = 255.0 * mandel256[i].blue;
+			cache[i] = rgb2xterm(rgb);
+		}
+		__sync_synchronize();
+		cached = 1;
+	}
 
 	if (color_val > 255)
 		color_val = 255;
 
+	color_val = cache[color_val];
+	assert(0 <= color_val && color_val <= 255);
+	return color_val;
+}
+
+/* The RGB palette color of a color value, for image files */
+void mandel_palette_rgb(int color_val, unsigned char *rgb)
+{
+	if (color_val > 255)
+		color_val = 255;
 	rgb[0] = 255.0 * mandel256[color_val].red;
 	rgb[1] = 255.0 * mandel256[color_val].green;
 	rgb[2] = 255.0 * mandel256[color_val].blue;
-	color_val = rgb2xterm(rgb);
-	
-	assert(0 <= color_val && color_val <= 255);
-	return color_val;
+}
+
+/*
+ * The xterm color closest to the average of the palette colors of n
+ * color values, for antialiasing.
+ */
+unsigned char xterm_color_blend(const int *color_vals, int n)
+{
+	double sum[3] = { 0, 0, 0 };
+	unsigned char rgb[3];
+	int i, v;
+
+	for (i = 0; i < n; i++) {
+		v = color_vals[i] > 255 ? 255 : color_vals[i];
+		sum[0] += mandel256[v].red;
+		sum[1] += mandel256[v].green;
+		sum[2] += mandel256[v].blue;
+	}
+	for (i = 0; i < 3; i++)
+		rgb[i] = 255.0 * sum[i] / n;
+	return rgb2xterm(rgb);
 }
 
 /*
@@ -458,6 +511,29 @@ ssize_t insist_write(int fd, const char *buf, size_t count)
 	return orig_count;
 }
 
+/*
+ * Insist until all count bytes have been read into buf from
+ * file descriptor fd. Returns 0 if end of file comes first.
+ */
+ssize_t insist_read(int fd, void *buf, size_t count)
+{
+	ssize_t ret;
+	size_t orig_count = count;
+	char *p = buf;
+
+	while (count > 0) {
+		ret = read(fd, p, count);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret;
+		p += ret;
+		count -= ret;
+	}
+
+	return orig_count;
+}
+
 /*
  * This function outputs the proper control sequence
  * to change the current color of a 256-color xterm.
@@ -484,3 +560,476 @@ void reset_xterm_color(int fd)
 		exit(1);
 	}
 }
+
+/*******************************************
+ *                                         *
+ * Compact iteration buffers               *
+ *                                         *
+ *******************************************/
+
+/*
+ * Set up b for n points with the given limit. The counts are stored
+ * in counts if given (a checkpoint mapping, say), otherwise in memory
+ * allocated here. Returns -1 if out of memory.
+ */
+int mandel_iterbuf_init(struct mandel_iterbuf *b, size_t n, int max,
+	uint16_t *counts)
+{
+	memset(b, 0, sizeof(*b));
+	b->n = n;
+	b->max = max;
+	b->counts = counts;
+	if (!counts) {
+		if ((b->counts = malloc(n * sizeof(*b->counts))) == NULL)
+			return -1;
+		b->own_counts = 1;
+	}
+	pthread_mutex_init(&b->lock, NULL);
+	return 0;
+}
+
+void mandel_iterbuf_destroy(struct mandel_iterbuf *b)
+{
+	if (b->own_counts)
+		free(b->counts);
+	free(b->ovf_keys);
+	free(b->ovf_vals);
+	pthread_mutex_destroy(&b->lock);
+}
+
+static size_t ovf_slot(size_t idx, size_t cap)
+{
+	return ((idx * 0x9e3779b97f4a7c15ULL) >> 32) & (cap - 1);
+}
+
+/* Insert or replace, the caller holds the lock and there is room */
+static void ovf_insert(struct mandel_iterbuf *b, size_t idx, int val)
+{
+	size_t i = ovf_slot(idx, b->ovf_cap);
+
+	while (b->ovf_keys[i] && b->ovf_keys[i] != idx + 1)
+		i = (i + 1) & (b->ovf_cap - 1);
+	if (!b->ovf_keys[i])
+		b->ovf_count++;
+	b->ovf_keys[i] = idx + 1;
+	b->ovf_vals[i] = val;
+}
+
+/* Store a count that does not fit in 16 bits */
+void mandel_iterbuf_overflow(struct mandel_iterbuf *b, size_t idx, int val)
+{
+	size_t *old_keys, old_cap, i;
+	int *old_vals;
+
+	pthread_mutex_lock(&b->lock);
+
+	/* Keep the table at most 3/4 full */
+	if ((b->ovf_count + 1) * 4 > b->ovf_cap * 3) {
+		old_keys = b->ovf_keys;
+		old_vals = b->ovf_vals;
+		old_cap = b->ovf_cap;
+		b->ovf_cap = old_cap ? 2 * old_cap : 64;
+		b->ovf_keys = calloc(b->ovf_cap, sizeof(*b->ovf_keys));
+		b->ovf_vals = malloc(b->ovf_cap * sizeof(*b->ovf_vals));
+		if (!b->ovf_keys || !b->ovf_vals) {
+			fprintf(stderr, "mandel_iterbuf_overflow: out of memory\n");
+			exit(1);
+		}
+		b->ovf_count = 0;
+		for (i = 0; i < old_cap; i++)
+			if (old_keys[i])
+				ovf_insert(b, old_keys[i] - 1, old_vals[i]);
+		free(old_keys);
+		free(old_vals);
+	}
+	ovf_insert(b, idx, val);
+	b->counts[idx] = MANDEL_ITER_OVERFLOW;
+
+	pthread_mutex_unlock(&b->lock);
+}
+
+int mandel_iterbuf_lookup(struct mandel_iterbuf *b, size_t idx)
+{
+	size_t i;
+
+	if (!b->ovf_cap)
+		return b->max;
+	for (i = ovf_slot(idx, b->ovf_cap); b->ovf_keys[i];
+	     i = (i + 1) & (b->ovf_cap - 1))
+		if (b->ovf_keys[i] == idx + 1)
+			return b->ovf_vals[i];
+	return b->max;
+}
+
+/*******************************************
+ *                                         *
+ * Render contexts and the shared pool     *
+ *                                         *
+ *******************************************/
+
+/*
+ * Set up a render of the given part of the complex plane: upper left
+ * corner (xmin, ymax), lower right corner (xmax, ymin). This is all
+ * mandel_ctx_span() needs; a render in a pool also needs the buffer
+ * of mandel_ctx_alloc().
+ */
+void mandel_ctx_init(struct mandel_ctx *ctx, double xmin, double xmax,
+	double ymin, double ymax, int x_chars, int y_chars, int max_iter)
+{
+	struct fractal_dd x0 = { xmin, 0 }, y0 = { ymax, 0 };
+
+	mandel_ctx_init_dd(ctx, x0, y0, xmax - xmin, ymax - ymin,
+		x_chars, y_chars, max_iter);
+}
+
+/*
+ * The same, with the upper left corner in double-double, for zooms so
+ * deep that width and height vanish next to it. Below a point spacing
+ * of MANDEL_DD_THRESHOLD, the kernels that have a double-double
+ * version switch to it.
+ */
+void mandel_ctx_init_dd(struct mandel_ctx *ctx, struct fractal_dd xmin,
+	struct fractal_dd ymax, double width, double height,
+	int x_chars, int y_chars, int max_iter)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->xmin = xmin.hi;
+	ctx->xmin_lo = xmin.lo;
+	ctx->ymax = ymax.hi;
+	ctx->ymax_lo = ymax.lo;
+	ctx->xstep = width / x_chars;
+	ctx->ystep = height / y_chars;
+	ctx->dd = ctx->xstep < MANDEL_DD_THRESHOLD || ctx->ystep < MANDEL_DD_THRESHOLD;
+	ctx->x_chars = x_chars;
+	ctx->y_chars = y_chars;
+	ctx->max_iter = max_iter;
+	ctx->kernel = fractal_find("mandel");
+	pthread_cond_init(&ctx->done, NULL);
+}
+
+/* The buffer for the iteration counts, returns -1 if out of memory */
+int mandel_ctx_alloc(struct mandel_ctx *ctx)
+{
+	return mandel_iterbuf_init(&ctx->iters, (size_t)ctx->x_chars * ctx->y_chars,
+		ctx->max_iter, NULL);
+}
+
+void mandel_ctx_destroy(struct mandel_ctx *ctx)
+{
+	if (ctx->iters.counts)
+		mandel_iterbuf_destroy(&ctx->iters);
+	pthread_cond_destroy(&ctx->done);
+}
+
+/* The point at (fractional) column col and row row of the render */
+static void ctx_coords(const struct mandel_ctx *ctx, double col, double row,
+	double *xh, double *xl, double *yh, double *yl)
+{
+	struct fractal_dd x = { ctx->xmin, ctx->xmin_lo }, y = { ctx->ymax, ctx->ymax_lo };
+
+	if (!mandel_ctx_dd(ctx)) {
+		*xh = ctx->xmin + ctx->xstep * col;
+		*yh = ctx->ymax - ctx->ystep * row;
+		return;
+	}
+	x = fractal_dd_add(x, ctx->xstep * col);
+	y = fractal_dd_add(y, -ctx->ystep * row);
+	*xh = x.hi;
+	*xl = x.lo;
+	*yh = y.hi;
+	*yl = y.lo;
+}
+
+/* Run the kernel of the render on n points, at most MANDEL_SPAN_CHUNK */
+static void ctx_run(const struct mandel_ctx *ctx, const double *xh, const double *xl,
+	const double *yh, const double *yl, int n, int max, int *iters)
+{
+	if (mandel_ctx_dd(ctx))
+		ctx->kernel->dd_batch(xh, xl, yh, yl, n, ctx->cr, ctx->ci, max, iters);
+	else
+		ctx->kernel->batch(xh, yh, n, ctx->cr, ctx->ci, max, iters);
+}
+
+/*
+ * The iteration counts of ncols points of a line, starting at column
+ * col0, with the given limit.
+ */
+void mandel_ctx_span(const struct mandel_ctx *ctx, int line, int col0, int ncols,
+	int max, int *iters)
+{
+	double xh[MANDEL_SPAN_CHUNK], xl[MANDEL_SPAN_CHUNK];
+	double yh[MANDEL_SPAN_CHUNK], yl[MANDEL_SPAN_CHUNK];
+	int n, i, len;
+
+	for (n = 0; n < ncols; n += len) {
+		len = ncols - n < MANDEL_SPAN_CHUNK ? ncols - n : MANDEL_SPAN_CHUNK;
+		for (i = 0; i < len; i++)
+			ctx_coords(ctx, col0 + n + i, line, &xh[i], &xl[i], &yh[i], &yl[i]);
+		ctx_run(ctx, xh, xl, yh, yl, len, max, iters + n);
+	}
+}
+
+/*
+ * One point with the kernel of the render, at (fractional) column col
+ * and row row
+ */
+int mandel_ctx_point(const struct mandel_ctx *ctx, double col, double row, int max)
+{
+	double xh, xl, yh, yl;
+
+	ctx_coords(ctx, col, row, &xh, &xl, &yh, &yl);
+	if (mandel_ctx_dd(ctx))
+		return ctx->kernel->dd_scalar(xh, xl, yh, yl, ctx->cr, ctx->ci, max);
+	return ctx->kernel->scalar(xh, yh, ctx->cr, ctx->ci, max);
+}
+
+/* Any n points with the kernel of the render, SIMD if it has one */
+void mandel_ctx_batch(const struct mandel_ctx *ctx, const double *cols,
+	const double *rows, int n, int max, int *iters)
+{
+	double xh[MANDEL_SPAN_CHUNK], xl[MANDEL_SPAN_CHUNK];
+	double yh[MANDEL_SPAN_CHUNK], yl[MANDEL_SPAN_CHUNK];
+	int i, j, len;
+
+	for (i = 0; i < n; i += len) {
+		len = n - i < MANDEL_SPAN_CHUNK ? n - i : MANDEL_SPAN_CHUNK;
+		for (j = 0; j < len; j++)
+			ctx_coords(ctx, cols[i + j], rows[i + j], &xh[j], &xl[j], &yh[j], &yl[j]);
+		ctx_run(ctx, xh, xl, yh, yl, len, max, iters + i);
+	}
+}
+
+static void *pool_thread(void *arg)
+{
+	struct mandel_pool *pool = arg;
+	struct mandel_ctx *ctx;
+	int *row = NULL, row_len = 0, r;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->queue && !pool->quit)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (!pool->queue)
+			break;
+
+		/* Next row of the most urgent render */
+		ctx = pool->queue;
+		r = ctx->next_row++;
+		if (ctx->next_row == ctx->y_chars)
+			pool->queue = ctx->next;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (ctx->x_chars > row_len) {
+			free(row);
+			row_len = ctx->x_chars;
+			if ((row = malloc(row_len * sizeof(*row))) == NULL) {
+				fprintf(stderr, "mandel pool: out of memory\n");
+				exit(1);
+			}
+		}
+		mandel_ctx_span(ctx, r, 0, ctx->x_chars, ctx->max_iter, row);
+		mandel_iterbuf_put(&ctx->iters, (size_t)r * ctx->x_chars, row, ctx->x_chars);
+
+		pthread_mutex_lock(&pool->lock);
+		if (++ctx->rows_done == ctx->y_chars)
+			pthread_cond_broadcast(&ctx->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(row);
+	return NULL;
+}
+
+/* Start nthreads pool threads, returns 0 or an error number */
+int mandel_pool_init(struct mandel_pool *pool, int nthreads)
+{
+	int i, ret;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	if ((pool->tids = malloc(nthreads * sizeof(*pool->tids))) == NULL)
+		return ENOMEM;
+	for (i = 0; i < nthreads; i++) {
+		ret = pthread_create(&pool->tids[i], NULL, pool_thread, pool);
+		if (ret) {
+			mandel_pool_destroy(pool);
+			return ret;
+		}
+		pool->nthreads++;
+	}
+	return 0;
+}
+
+/* Queue a render behind the ones of equal or higher priority */
+void mandel_pool_submit(struct mandel_pool *pool, struct mandel_ctx *ctx)
+{
+	struct mandel_ctx **pp;
+
+	pthread_mutex_lock(&pool->lock);
+	ctx->next_row = 0;
+	ctx->rows_done = 0;
+	for (pp = &pool->queue; *pp && (*pp)->priority >= ctx->priority; pp = &(*pp)->next)
+		;
+	ctx->next = *pp;
+	*pp = ctx;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Wait until every row of a submitted render is done */
+void mandel_pool_wait(struct mandel_pool *pool, struct mandel_ctx *ctx)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (ctx->rows_done < ctx->y_chars)
+		pthread_cond_wait(&ctx->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Stop the threads once the renders submitted so far are handed out */
+void mandel_pool_destroy(struct mandel_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nthreads; i++)
+		pthread_join(pool->tids[i], NULL);
+	free(pool->tids);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+}
+
+/*******************************************
+ *                                         *
+ * Render checkpoints                      *
+ *                                         *
+ *******************************************/
+
+static void ovf_path(char *buf, size_t len, const char *path)
+{
+	snprintf(buf, len, "%s.ovf", path);
+}
+
+/*
+ * Map the checkpoint file at path. With resume set, the file must
+ * hold a checkpoint of the very same render; otherwise a new, empty
+ * one is created. Returns -1 with errno set on failure, EINVAL if the
+ * file does not match.
+ */
+int mandel_ckpt_open(struct mandel_ckpt *ck, const char *path,
+	const struct mandel_ckpt_header *hdr, int resume)
+{
+	struct mandel_ckpt_ovf rec;
+	size_t words, npoints, len;
+	char opath[4096];
+	struct stat st;
+	char *p;
+	int fd;
+
+	words = (hdr->y_chars + 63) / 64;
+	npoints = (size_t)hdr->x_chars * hdr->y_chars;
+	len = sizeof(*hdr) + words * sizeof(uint64_t) + npoints * sizeof(uint16_t);
+
+	fd = open(path, resume ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (resume && (fstat(fd, &st) < 0 || st.st_size != len)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if (!resume && ftruncate(fd, len) < 0) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	ck->hdr = (struct mandel_ckpt_header *)p;
+	ck->done = (volatile uint64_t *)(p + sizeof(*hdr));
+	ck->len = len;
+
+	if (!resume)
+		*ck->hdr = *hdr;
+	else if (memcmp(ck->hdr, hdr, sizeof(*hdr)) != 0) {
+		munmap(p, len);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (mandel_iterbuf_init(&ck->iters, npoints, hdr->max_iter,
+		(uint16_t *)(p + sizeof(*hdr) + words * sizeof(uint64_t))) < 0) {
+		munmap(p, len);
+		return -1;
+	}
+
+	/* The side table is rebuilt from its log */
+	ovf_path(opath, sizeof(opath), path);
+	ck->ovf_fd = open(opath, O_RDWR | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+	if (ck->ovf_fd < 0) {
+		mandel_iterbuf_destroy(&ck->iters);
+		munmap(p, len);
+		return -1;
+	}
+	while (insist_read(ck->ovf_fd, &rec, sizeof(rec)) == sizeof(rec))
+		if (rec.idx < npoints)
+			mandel_iterbuf_overflow(&ck->iters, rec.idx, rec.val);
+	return 0;
+}
+
+/*
+ * Store the counts of a row, logging the ones that overflow. A single
+ * small O_APPEND write never interleaves with another thread's.
+ */
+void mandel_ckpt_put_row(struct mandel_ckpt *ck, int row, const int *vals)
+{
+	struct mandel_ckpt_ovf rec;
+	size_t idx0 = (size_t)row * ck->hdr->x_chars;
+	int i;
+
+	for (i = 0; i < ck->hdr->x_chars; i++) {
+		if (mandel_iterbuf_overflows(&ck->iters, vals[i])) {
+			rec.idx = idx0 + i;
+			rec.val = vals[i];
+			rec.reserved = 0;
+			if (insist_write(ck->ovf_fd, (char *)&rec, sizeof(rec)) != sizeof(rec))
+				perror("mandel_ckpt_put_row: write");
+		}
+		mandel_iterbuf_set(&ck->iters, idx0 + i, vals[i]);
+	}
+}
+
+/* Flush the checkpoint to the files and unmap it */
+void mandel_ckpt_close(struct mandel_ckpt *ck)
+{
+	if (msync(ck->hdr, ck->len, MS_SYNC) < 0)
+		perror("mandel_ckpt_close: msync");
+	if (fsync(ck->ovf_fd) < 0)
+		perror("mandel_ckpt_close: fsync");
+	close(ck->ovf_fd);
+	mandel_iterbuf_destroy(&ck->iters);
+	munmap(ck->hdr, ck->len);
+}
+
+/* Remove a checkpoint that is no longer needed */
+void mandel_ckpt_unlink(const char *path)
+{
+	char opath[4096];
+
+	ovf_path(opath, sizeof(opath), path);
+	unlink(path);
+	unlink(opath);
+}
+
+int mandel_ckpt_rows_done(struct mandel_ckpt *ck)
+{
+	int row, n = 0;
+
+	for (row = 0; row < ck->hdr->y_chars; row++)
+		n += mandel_ckpt_row_done(ck, row);
+	return n;
+}
@@ -9,11 +9,218 @@
 #ifndef MANDEL_LIB_H__
 #define MANDEL_LIB_H__
 
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "fractal-lib.h"
+
+#define MANDEL_SPAN_CHUNK	256	/* Points per kernel call in mandel_ctx_span() */
+
+/*
+ * Point spacing below which double runs out of bits: neighbouring
+ * points only differ in the last few bits of their coordinates, and
+ * the rounding errors of the iterations swamp the difference.
+ */
+#define MANDEL_DD_THRESHOLD	1e-13
+
+/*
+ * A compact buffer of iteration counts, 16 bits per point. Points
+ * that reached the limit (inside the set, most of the big ones) are
+ * stored as MANDEL_ITER_AT_MAX; the rare counts that do not fit are
+ * stored as MANDEL_ITER_OVERFLOW and kept in a hash table on the side.
+ *
+ * Writers may store points concurrently; the side table has a lock.
+ * Reads take no lock, so they must not overlap with writers.
+ */
+#define MANDEL_ITER_AT_MAX	0xffff
+#define MANDEL_ITER_OVERFLOW	0xfffe
+
+struct mandel_iterbuf {
+	uint16_t *counts;
+	size_t n;
+	int max;
+	int own_counts;		/* counts was allocated here */
+
+	pthread_mutex_t lock;	/* Side table of the counts that overflow */
+	size_t *ovf_keys;	/* Point index + 1, 0 for a free slot */
+	int *ovf_vals;
+	size_t ovf_cap, ovf_count;
+};
+
+/*
+ * Everything one render needs: the viewport, the geometry and the
+ * buffer for its iteration counts. Nothing else is shared, so any
+ * number of renders can run at once, in one pool or each on its own.
+ */
+struct mandel_ctx {
+	double xmin, ymax;		/* Upper left corner */
+	double xmin_lo, ymax_lo;	/* ... and what double misses of it */
+	double xstep, ystep;		/* Size of one point */
+	int dd;				/* Below MANDEL_DD_THRESHOLD */
+	int x_chars, y_chars;
+	int max_iter;
+	const struct fractal_kernel *kernel;	/* The plain Mandelbrot set by default */
+	double cr, ci;			/* c of a Julia set */
+	int priority;			/* Higher goes first in a pool */
+	struct mandel_iterbuf iters;	/* See mandel_ctx_alloc() */
+
+	/* Owned by the pool while submitted */
+	struct mandel_ctx *next;
+	int next_row, rows_done;
+	pthread_cond_t done;
+};
+
+/*
+ * A pool of threads shared by all the renders submitted to it. Rows
+ * are handed out one at a time from the render with the highest
+ * priority (first come, first served among equals), so a new urgent
+ * render takes over the threads at the next row boundary.
+ */
+struct mandel_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct mandel_ctx *queue;	/* Renders with rows left to hand out */
+	pthread_t *tids;
+	int nthreads;
+	int quit;
+};
+
+#define MANDEL_CKPT_MAGIC	0x6d616e64636b0004ULL	/* "mandck", version 4 */
+
+/*
+ * A render checkpoint: a file mapped MAP_SHARED, so every row that is
+ * marked done is already in the page cache and survives the process.
+ * The header is followed by a bitmap of the completed rows and the
+ * iteration counts, an iterbuf row by row. The counts that overflow
+ * are appended to path.ovf as they are stored, and loaded on resume.
+ */
+struct mandel_ckpt_header {
+	uint64_t magic;
+	int32_t x_chars, y_chars;
+	int32_t max_iter;
+	int32_t kernel;		/* Index in fractal_kernels[] */
+	double xmin, xmax, ymin, ymax;
+	double xmin_lo, ymax_lo;
+	double cr, ci;
+};
+
+struct mandel_ckpt {
+	struct mandel_ckpt_header *hdr;
+	volatile uint64_t *done;	/* One bit per row */
+	struct mandel_iterbuf iters;
+	size_t len;
+	int ovf_fd;
+};
+
+/* One record of path.ovf */
+struct mandel_ckpt_ovf {
+	uint64_t idx;
+	int32_t val;
+	int32_t reserved;
+};
+
 /* Function prototypes */
 int mandel_iterations_at_point(double x, double y, int max);
 unsigned char xterm_color(int color_val);
+unsigned char xterm_color_blend(const int *color_vals, int n);
+void mandel_palette_rgb(int color_val, unsigned char *rgb);
 ssize_t insist_write(int fd, const char *buf, size_t count);
+ssize_t insist_read(int fd, void *buf, size_t count);
 void set_xterm_color(int fd, unsigned char color);
 void reset_xterm_color(int fd);
+int mandel_iterbuf_init(struct mandel_iterbuf *b, size_t n, int max,
+	uint16_t *counts);
+void mandel_iterbuf_destroy(struct mandel_iterbuf *b);
+void mandel_iterbuf_overflow(struct mandel_iterbuf *b, size_t idx, int val);
+int mandel_iterbuf_lookup(struct mandel_iterbuf *b, size_t idx);
+
+/* Counts that need the side table */
+static inline int mandel_iterbuf_overflows(struct mandel_iterbuf *b, int val)
+{
+	return val < b->max && val >= MANDEL_ITER_OVERFLOW;
+}
+
+static inline void mandel_iterbuf_set(struct mandel_iterbuf *b, size_t idx, int val)
+{
+	if (val >= b->max)
+		b->counts[idx] = MANDEL_ITER_AT_MAX;
+	else if (val < MANDEL_ITER_OVERFLOW)
+		b->counts[idx] = val;
+	else
+		mandel_iterbuf_overflow(b, idx, val);
+}
+
+static inline int mandel_iterbuf_get(struct mandel_iterbuf *b, size_t idx)
+{
+	int c = b->counts[idx];
+
+	if (c < MANDEL_ITER_OVERFLOW)
+		return c;
+	if (c == MANDEL_ITER_AT_MAX)
+		return b->max;
+	return mandel_iterbuf_lookup(b, idx);
+}
+
+/* Store or load n consecutive points */
+static inline void mandel_iterbuf_put(struct mandel_iterbuf *b, size_t idx,
+	const int *vals, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		mandel_iterbuf_set(b, idx + i, vals[i]);
+}
+
+static inline void mandel_iterbuf_fetch(struct mandel_iterbuf *b, size_t idx,
+	int *vals, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		vals[i] = mandel_iterbuf_get(b, idx + i);
+}
+
+void mandel_ctx_init(struct mandel_ctx *ctx, double xmin, double xmax,
+	double ymin, double ymax, int x_chars, int y_chars, int max_iter);
+void mandel_ctx_init_dd(struct mandel_ctx *ctx, struct fractal_dd xmin,
+	struct fractal_dd ymax, double width, double height,
+	int x_chars, int y_chars, int max_iter);
+int mandel_ctx_alloc(struct mandel_ctx *ctx);
+void mandel_ctx_destroy(struct mandel_ctx *ctx);
+
+/* Whether the render runs in double-double: it needs, and has, a kernel for it */
+static inline int mandel_ctx_dd(const struct mandel_ctx *ctx)
+{
+	return ctx->dd && ctx->kernel->dd_batch;
+}
+
+void mandel_ctx_span(const struct mandel_ctx *ctx, int line, int col0, int ncols,
+	int max, int *iters);
+int mandel_ctx_point(const struct mandel_ctx *ctx, double col, double row, int max);
+void mandel_ctx_batch(const struct mandel_ctx *ctx, const double *cols,
+	const double *rows, int n, int max, int *iters);
+int mandel_pool_init(struct mandel_pool *pool, int nthreads);
+void mandel_pool_submit(struct mandel_pool *pool, struct mandel_ctx *ctx);
+void mandel_pool_wait(struct mandel_pool *pool, struct mandel_ctx *ctx);
+void mandel_pool_destroy(struct mandel_pool *pool);
+
+int mandel_ckpt_open(struct mandel_ckpt *ck, const char *path,
+	const struct mandel_ckpt_header *hdr, int resume);
+void mandel_ckpt_put_row(struct mandel_ckpt *ck, int row, const int *vals);
+void mandel_ckpt_close(struct mandel_ckpt *ck);
+void mandel_ckpt_unlink(const char *path);
+int mandel_ckpt_rows_done(struct mandel_ckpt *ck);
+
+static inline int mandel_ckpt_row_done(struct mandel_ckpt *ck, int row)
+{
+	return (ck->done[row / 64] >> (row % 64)) & 1;
+}
+
+/* Only after the row's iteration counts are all stored */
+static inline void mandel_ckpt_mark(struct mandel_ckpt *ck, int row)
+{
+	__sync_fetch_and_or(&ck->done[row / 64], (uint64_t)1 << (row % 64));
+}
 
 #endif /* MANDEL_LIB_H__ */
@@ -5,6 +5,8 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
@@ -14,7 +16,18 @@
 #include <semaphore.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/socket.h>
 #include "mandel-lib.h"
+#include "farm-lib.h"
+#include "topo-lib.h"
 #include <signal.h>
 
 #define MANDEL_MAX_ITERATION 100000
@@ -27,6 +40,14 @@
 #define perror_pthread(ret, msg) \
         do { errno = ret; perror(msg); } while (0)
 
+/* Set by SIGINT or SIGTERM while rendering to a checkpoint (-C) */
+volatile sig_atomic_t stop_requested = 0;
+
+void stop_handler(int signum)
+{
+        stop_requested = 1;
+}
+
 /*
 Sigint(ctrl+c) handler
 */
@@ -53,11 +74,11 @@ double xmin = -1.8, xmax = 1.0;
 double ymin = -1.0, ymax = 1.0;
 
 /*
- * Every character in the final output is
- * xstep x ystep units wide on the complex plane.
+ * The render these parameters describe. Every character in the final
+ * output is view.xstep x view.ystep units wide on the complex plane.
+ * The kernels only read the view, never the globals above.
  */
-double xstep;
-double ystep;
+struct mandel_ctx view;
 
 struct thread_info_struct {
     pthread_t tid;
@@ -67,40 +88,95 @@ struct thread_info_struct {
 
     int thrid; /* Application-defined thread id */
     int nThreads;
+    int cpu;   /* CPU we are pinned to, -1 if none */
 };
 
+/* Worker placement policy (-a) */
+enum topo_policy placement = TOPO_NONE;
+struct topology topo;
+
+/* Fork worker processes instead of creating threads (-p) */
+int use_processes = 0;
+
+/* Render through a checkpoint file (-C), continuing an old one (--resume) */
+char *ckpt_path = NULL;
+int resume = 0;
+struct mandel_ckpt ckpt;
+volatile int ckpt_next_row = 0;
+
+/* Print the render time on stderr (-v) */
+int verbose = 0;
+
+/* The fractal (-k), the c of Julia sets (-j), benchmark the kernels (--bench) */
+const struct fractal_kernel *kernel = NULL;
+double julia_cr = 0.1, julia_ci = 0.55;
+int bench = 0;
+
 /*
- * This function computes a line of output
- * as an array of x_char color values.
+ * Zoom (-c, -w): the center in double-double, so that it can be
+ * given to more digits than a double holds, and the width
  */
+struct fractal_dd center_x, center_y;
+int have_center = 0;
+double view_width = 0;
 
-void compute_mandel_line(int line, int color_val[])
-{
-        /*
-         * x and y traverse the complex plane.
-         */
-        double x, y;
+/*
+ * Process mode: everything the workers and the parent share lives in
+ * one anonymous MAP_SHARED mapping, created before fork(). Workers
+ * claim rows from next_row, compute them straight into colors[] and
+ * post the row's semaphore. The parent outputs the rows in order.
+ */
+struct proc_shared {
+        volatile int next_row;
+        volatile int *owner;    /* Worker id + 1 that claimed each row */
+        sem_t *row_done;        /* Process-shared, one per row */
+        int *colors;            /* y_chars rows of x_chars color values */
+};
 
-        int n;
-        int val;
+/*
+ * This function computes the iteration counts of ncols points
+ * of a line, starting at column col0.
+ */
 
-        /* Find out the y value corresponding to this line */
-        y = ymax - ystep * line;
+void compute_iterations_span(int line, int col0, int ncols, int max, int iters[])
+{
+        mandel_ctx_span(&view, line, col0, ncols, max, iters);
+}
 
-        /* and iterate for all points on this line */
-        for (x = xmin, n = 0; n < x_chars; x+= xstep, n++) {
+/* Turn iteration counts into color values, in place */
+void color_span(int ncols, int color_val[])
+{
+        int n, val;
 
-                /* Compute the point's color value */
-                val = mandel_iterations_at_point(x, y, MANDEL_MAX_ITERATION);
+        for (n = 0; n < ncols; n++) {
+                val = color_val[n];
                 if (val > 255)
                         val = 255;
-                
-                /* And store it in the color_val[] array */
-                val = xterm_color(val);
-                color_val[n] = val;
+                color_val[n] = xterm_color(val);
         }
 }
 
+/*
+ * This function computes ncols characters of a line of output,
+ * starting at column col0, as an array of color values.
+ */
+
+void compute_mandel_span(int line, int col0, int ncols, int max, int color_val[])
+{
+        compute_iterations_span(line, col0, ncols, max, color_val);
+        color_span(ncols, color_val);
+}
+
+/*
+ * This function computes a line of output
+ * as an array of x_char color values.
+ */
+
+void compute_mandel_line(int line, int color_val[])
+{
+        compute_mandel_span(line, 0, x_chars, MANDEL_MAX_ITERATION, color_val);
+}
+
 /*
  * This function outputs an array of x_char color values
  * to a 256-color xterm.
@@ -109,22 +185,22 @@ void compute_mandel_line(int line, int color_val[])
 void output_mandel_line(int fd, int color_val[])
 {
         int i;
+        size_t len = 0;
 
-        char point ='@';
-        char newline='\n';
+        /* "\033[38;5;NNNm@" per point, then the newline */
+        char buf[x_chars * 12 + 1];
 
         for (i = 0; i < x_chars; i++) {
                 /* Set the current color, then output the point */
-                set_xterm_color(fd, color_val[i]);
-                if (write(fd, &point, 1) != 1) {
-                        perror("compute_and_output_mandel_line: write point");
-                        exit(1);
-                }
+                len += sprintf(buf + len, "\033[38;5;%dm@", (unsigned char)color_val[i]);
         }
 
         /* Now that the line is done, output a newline character */
-        if (write(fd, &newline, 1) != 1) {
-                perror("compute_and_output_mandel_line: write newline");
+        buf[len++] = '\n';
+
+        /* One write per line instead of two per point */
+        if (insist_write(fd, buf, len) != len) {
+                perror("output_mandel_line: write");
                 exit(1);
         }
 }
@@ -135,6 +211,9 @@ void *compute_and_output_mandel_line(void* arg)
 
         /* We know arg points to an instance of thread_info_struct */
         struct thread_info_struct *thr = arg;
+
+        topo_bind_self(thr->cpu);
+
         /*
          * A temporary array, used to hold color values for the line being drawn
          */
@@ -177,86 +256,1866 @@ void *safe_malloc(size_t size)
         return p;
 }
 
+/* Start fn on nThreads threads, placed by the -a policy */
+struct thread_info_struct *start_workers(int nThreads, void *(*fn)(void *))
+{
+        struct thread_info_struct *thr;
+        int i, ret;
 
-void usage(char *argv0)
+        thr = safe_malloc(nThreads * sizeof(*thr));
+        for (i = 0; i < nThreads; i++) {
+                thr[i].thrid = i;
+                thr[i].nThreads = nThreads;
+                thr[i].cpu = topo_place(&topo, placement, i, nThreads);
+                ret = pthread_create(&thr[i].tid, NULL, fn, &thr[i]);
+                if (ret) {
+                        perror_pthread(ret, "pthread_create");
+                        exit(1);
+                }
+        }
+        return thr;
+}
+
+void join_workers(struct thread_info_struct *thr, int nThreads)
 {
-        fprintf(stderr, "Usage: %s thread_count\n\n"
-                "Exactly one argument required:\n"
-                "    thread_count: The number of threads to create.\n", argv0);
-        exit(1);
+        int i, ret;
+
+        for (i = 0; i < nThreads; i++) {
+                ret = pthread_join(thr[i].tid, NULL);
+                if (ret) {
+                        perror_pthread(ret, "pthread_join");
+                        exit(1);
+                }
+        }
+        free(thr);
 }
 
+/* Run fn on nThreads threads and wait for all of them */
+void run_workers(int nThreads, void *(*fn)(void *))
+{
+        join_workers(start_workers(nThreads, fn), nThreads);
+}
 
-int main(int argc, char *argv[])
+/*
+ * Checkpointed rendering: the threads claim the rows that are still
+ * missing from the checkpoint and store their iteration counts in the
+ * mapped file. A stop request is only looked at between rows, so
+ * every row marked done is complete.
+ */
+void *checkpoint_worker(void *arg)
 {
-        int i, ret, nThreads;
-        struct thread_info_struct *thr;
+        struct thread_info_struct *thr = arg;
+        int row;
+        int *iters = safe_malloc(x_chars * sizeof(*iters));
 
-        if (argc != 2) {
-            usage(argv[0]);
+        topo_bind_self(thr->cpu);
+
+        while (!stop_requested) {
+                row = __sync_fetch_and_add(&ckpt_next_row, 1);
+                if (row >= y_chars)
+                        break;
+                if (mandel_ckpt_row_done(&ckpt, row))
+                        continue;
+                compute_iterations_span(row, 0, x_chars, MANDEL_MAX_ITERATION, iters);
+                mandel_ckpt_put_row(&ckpt, row, iters);
+                mandel_ckpt_mark(&ckpt, row);
         }
-        if (safe_atoi(argv[1], &nThreads) < 0 || nThreads <= 0) {
-                fprintf(stderr, "`%s' is not valid for `thread_count'\n", argv[1]);
+        free(iters);
+        return NULL;
+}
+
+void render_checkpointed(int nThreads)
+{
+        struct mandel_ckpt_header hdr;
+        int i, done;
+        int *color_val;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = MANDEL_CKPT_MAGIC;
+        hdr.x_chars = x_chars;
+        hdr.y_chars = y_chars;
+        hdr.max_iter = MANDEL_MAX_ITERATION;
+        hdr.xmin = xmin;
+        hdr.xmax = xmax;
+        hdr.ymin = ymin;
+        hdr.ymax = ymax;
+        hdr.xmin_lo = view.xmin_lo;
+        hdr.ymax_lo = view.ymax_lo;
+        hdr.kernel = kernel - fractal_kernels;
+        hdr.cr = view.cr;
+        hdr.ci = view.ci;
+        if (mandel_ckpt_open(&ckpt, ckpt_path, &hdr, resume) < 0) {
+                if (errno == EINVAL)
+                        fprintf(stderr, "%s: not a checkpoint of this render\n", ckpt_path);
+                else
+                        perror(ckpt_path);
                 exit(1);
         }
+        if (resume && verbose)
+                fprintf(stderr, "Resuming with %d of %d rows done\n",
+                        mandel_ckpt_rows_done(&ckpt), y_chars);
 
-        sem_t *semaphores = safe_malloc(nThreads *sizeof(*semaphores));
+        run_workers(nThreads, checkpoint_worker);
 
-        sem_init(&semaphores[0], 0, 1); // output initiation thread (first)
-        for(i=1; i<nThreads; i++){
-            sem_init(&semaphores[i], 0, 0); // output threads block initially
+        done = mandel_ckpt_rows_done(&ckpt);
+        if (done < y_chars) {
+                mandel_ckpt_close(&ckpt);
+                fprintf(stderr, "Stopped with %d of %d rows saved in %s, "
+                        "continue with --resume\n", done, y_chars, ckpt_path);
+                exit(1);
         }
 
-        thr = safe_malloc(nThreads * sizeof(*thr));
+        color_val = safe_malloc(x_chars * sizeof(*color_val));
+        for (i = 0; i < y_chars; i++) {
+                mandel_iterbuf_fetch(&ckpt.iters, (size_t)i * x_chars, color_val, x_chars);
+                color_span(x_chars, color_val);
+                output_mandel_line(1, color_val);
+        }
+        free(color_val);
 
-        xstep = (xmax - xmin) / x_chars;        
-        ystep = (ymax - ymin) / y_chars;
+        /* The image is out, the checkpoint has served its purpose */
+        mandel_ckpt_close(&ckpt);
+        mandel_ckpt_unlink(ckpt_path);
+}
 
-        struct sigaction act;
-        sigset_t sigset;
-        act.sa_handler=sigint_handler;
-        sigemptyset(&sigset);
-        act.sa_mask=sigset;
-        act.sa_flags=SA_RESTART;
-        if(sigaction(SIGINT, &act, NULL) == -1) {
-                perror("sigaction");
-                exit(EXIT_FAILURE);
+static double now_sec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct proc_shared *proc_shared_create(void)
+{
+        struct proc_shared *sh;
+        size_t len;
+        char *p;
+        int i;
+
+        len = sizeof(*sh) + y_chars * (sizeof(*sh->owner) + sizeof(*sh->row_done)) +
+                (size_t)y_chars * x_chars * sizeof(*sh->colors);
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+                perror("mmap");
+                exit(1);
         }
 
-        
-        /*
-         * draw the Mandelbrot Set, one line at a time.
-         * Output is sent to file descriptor '1', i.e., standard output.
-         */
+        /* The mapping is zero-filled: no row is claimed yet */
+        sh = (struct proc_shared *)p;
+        p += sizeof(*sh);
+        sh->row_done = (sem_t *)p;
+        p += y_chars * sizeof(*sh->row_done);
+        sh->owner = (volatile int *)p;
+        p += y_chars * sizeof(*sh->owner);
+        sh->colors = (int *)p;
 
-        for(i=0; i<nThreads; i++){
-                /* Initialize per-thread structure */
-                thr[i].nThreads = nThreads;
-                thr[i].thrid = i;
-                thr[i].semaphores = semaphores;
-                thr[i].fd = 1;
+        for (i = 0; i < y_chars; i++)
+                if (sem_init(&sh->row_done[i], 1, 0) < 0) {
+                        perror("sem_init");
+                        exit(1);
+                }
+        return sh;
+}
 
-                /* Spawn new thread */
-                ret = pthread_create(&thr[i].tid, NULL, compute_and_output_mandel_line, &thr[i]);
+void proc_worker(struct proc_shared *sh, int id, int cpu)
+{
+        int row;
+
+        /* Only the parent restores the terminal */
+        signal(SIGINT, SIG_DFL);
+        topo_bind_self(cpu);
+
+        for (;;) {
+                row = __sync_fetch_and_add(&sh->next_row, 1);
+                if (row >= y_chars)
+                        break;
+                sh->owner[row] = id + 1;
+                compute_mandel_line(row, &sh->colors[row * x_chars]);
+                sem_post(&sh->row_done[row]);
+        }
+        _exit(0);
+}
+
+/*
+ * Reap the workers that have exited. Returns how many are still
+ * running; the ones that did not exit cleanly are marked as crashed.
+ */
+int proc_reap(pid_t *pids, int *crashed, int nprocs, int options)
+{
+        int i, status, alive = 0;
+        pid_t pid;
+
+        while ((pid = waitpid(-1, &status, options)) > 0) {
+                for (i = 0; i < nprocs; i++)
+                        if (pids[i] == pid)
+                                break;
+                if (i == nprocs)
+                        continue;
+                pids[i] = 0;
+                if (WIFSIGNALED(status) || WEXITSTATUS(status) != 0) {
+                        crashed[i] = 1;
+                        if (WIFSIGNALED(status))
+                                fprintf(stderr, "Worker %d (pid %d) killed by signal %d\n",
+                                        i, pid, WTERMSIG(status));
+                        else
+                                fprintf(stderr, "Worker %d (pid %d) exited with status %d\n",
+                                        i, pid, WEXITSTATUS(status));
+                }
+        }
+        for (i = 0; i < nprocs; i++)
+                if (pids[i])
+                        alive++;
+        return alive;
+}
+
+/*
+ * Draw the set with nprocs forked workers. While it waits for a row,
+ * the parent polls for workers that died. A row whose owner crashed,
+ * or that is still missing once every worker is gone (its owner died
+ * right after claiming it), is computed by the parent itself.
+ */
+void render_processes(int nprocs)
+{
+        struct proc_shared *sh;
+        struct timespec ts;
+        pid_t *pids;
+        int *crashed;
+        int i, row, owner, alive, redone = 0;
+
+        sh = proc_shared_create();
+        pids = safe_malloc(nprocs * sizeof(*pids));
+        crashed = safe_malloc(nprocs * sizeof(*crashed));
+        memset(crashed, 0, nprocs * sizeof(*crashed));
+
+        for (i = 0; i < nprocs; i++) {
+                pids[i] = fork();
+                if (pids[i] < 0) {
+                        perror("fork");
+                        exit(1);
+                }
+                if (pids[i] == 0)
+                        proc_worker(sh, i, topo_place(&topo, placement, i, nprocs));
+        }
+        alive = nprocs;
+
+        for (row = 0; row < y_chars; row++) {
+                for (;;) {
+                        clock_gettime(CLOCK_REALTIME, &ts);
+                        ts.tv_nsec += 100000000;
+                        if (ts.tv_nsec >= 1000000000) {
+                                ts.tv_sec++;
+                                ts.tv_nsec -= 1000000000;
+                        }
+                        if (sem_timedwait(&sh->row_done[row], &ts) == 0)
+                                break;
+                        if (errno == EINTR)
+                                continue;
+                        if (errno != ETIMEDOUT) {
+                                perror("sem_timedwait");
+                                exit(1);
+                        }
+                        if (alive)
+                                alive = proc_reap(pids, crashed, nprocs, WNOHANG);
+                        owner = sh->owner[row];
+                        if ((owner && crashed[owner - 1]) || !alive) {
+                                compute_mandel_line(row, &sh->colors[row * x_chars]);
+                                redone++;
+                                break;
+                        }
+                }
+                output_mandel_line(1, &sh->colors[row * x_chars]);
+        }
+
+        proc_reap(pids, crashed, nprocs, 0);
+        if (redone)
+                fprintf(stderr, "%d rows computed again after worker crashes\n", redone);
+
+        for (i = 0; i < y_chars; i++)
+                sem_destroy(&sh->row_done[i]);
+        free(pids);
+        free(crashed);
+}
+
+
+/*
+ * Render farm worker (--worker): connect to the coordinator and render
+ * the tiles it sends with a pool of nThreads threads. The threads meet
+ * the connection thread at two barriers per tile and claim the tile's
+ * rows from a shared counter in between.
+ */
+struct farm_pool {
+        pthread_barrier_t start, done;
+        struct farm_tile tile;
+        int *colors;
+        volatile int next_row;
+        int quit;
+};
+
+void *farm_pool_thread(void *arg)
+{
+        struct farm_pool *pool = arg;
+        struct farm_tile *t = &pool->tile;
+        int r;
+
+        for (;;) {
+                pthread_barrier_wait(&pool->start);
+                if (pool->quit)
+                        break;
+                while ((r = __sync_fetch_and_add(&pool->next_row, 1)) < t->nrows)
+                        compute_mandel_span(t->row0 + r, t->col0, t->ncols, t->max_iter,
+                                            &pool->colors[r * t->ncols]);
+                pthread_barrier_wait(&pool->done);
+        }
+        return NULL;
+}
+
+void farm_worker(const char *path, int nThreads)
+{
+        struct farm_setup setup;
+        struct farm_result res;
+        struct farm_pool pool;
+        pthread_t *tids;
+        size_t len, max_len = 0;
+        int i, ret, fd;
+
+        if ((fd = farm_connect(path, 5000)) < 0) {
+                perror(path);
+                exit(1);
+        }
+        if (insist_read(fd, &setup, sizeof(setup)) != sizeof(setup)) {
+                fprintf(stderr, "%s: no setup from the coordinator\n", path);
+                exit(1);
+        }
+        view.xmin = setup.xmin;
+        view.ymax = setup.ymax;
+        view.xstep = setup.xstep;
+        view.ystep = setup.ystep;
+        view.xmin_lo = setup.xmin_lo;
+        view.ymax_lo = setup.ymax_lo;
+        view.dd = setup.dd;
+        if (setup.kernel < 0 || setup.kernel >= fractal_nkernels) {
+                fprintf(stderr, "%s: unknown kernel %d\n", path, setup.kernel);
+                exit(1);
+        }
+        view.kernel = &fractal_kernels[setup.kernel];
+        view.cr = setup.cr;
+        view.ci = setup.ci;
+
+        memset(&pool, 0, sizeof(pool));
+        pthread_barrier_init(&pool.start, NULL, nThreads + 1);
+        pthread_barrier_init(&pool.done, NULL, nThreads + 1);
+        tids = safe_malloc(nThreads * sizeof(*tids));
+        for (i = 0; i < nThreads; i++) {
+                ret = pthread_create(&tids[i], NULL, farm_pool_thread, &pool);
                 if (ret) {
-                    perror_pthread(ret, "pthread_create");
-                    exit(1);
+                        perror_pthread(ret, "pthread_create");
+                        exit(1);
+                }
+        }
+
+        /* The coordinator closes the connection when the image is done */
+        while (insist_read(fd, &pool.tile, sizeof(pool.tile)) == sizeof(pool.tile)) {
+                len = (size_t)pool.tile.nrows * pool.tile.ncols * sizeof(*pool.colors);
+                if (len > max_len) {
+                        free(pool.colors);
+                        pool.colors = safe_malloc(len);
+                        max_len = len;
+                }
+                pool.next_row = 0;
+                pthread_barrier_wait(&pool.start);
+                pthread_barrier_wait(&pool.done);
+
+                res.id = pool.tile.id;
+                res.nrows = pool.tile.nrows;
+                res.ncols = pool.tile.ncols;
+                if (insist_write(fd, (char *)&res, sizeof(res)) != sizeof(res) ||
+                    insist_write(fd, (char *)pool.colors, len) != len)
+                        break;
+        }
+
+        pool.quit = 1;
+        pthread_barrier_wait(&pool.start);
+        for (i = 0; i < nThreads; i++)
+                pthread_join(tids[i], NULL);
+        close(fd);
+        exit(0);
+}
+
+/*
+ * Render farm coordinator (-f). The viewport is cut into tiles, which
+ * are handed out one at a time to whichever worker is idle, lowest
+ * first, so the output can follow in order as soon as a band of tiles
+ * is complete.
+ *
+ * A worker that disconnects gives its tile back. Once nothing is left
+ * to hand out, an idle worker gets a copy of the tile that has been
+ * running the longest, if that is well over the average tile time:
+ * the first copy to come back wins, and a stuck or slow worker no
+ * longer holds up the whole image.
+ */
+#define FARM_MAX_COPIES 3
+#define FARM_MAX_CONNS  256
+
+enum { TILE_TODO, TILE_RUNNING, TILE_DONE };
+
+struct farm_tile_state {
+        struct farm_tile t;
+        int state;
+        int copies;             /* Workers rendering it right now */
+        double start;           /* When the first running copy was sent */
+};
+
+struct farm_conn {
+        int fd;
+        int tile;               /* Tile it is rendering, -1 if idle */
+        char *buf;              /* Result being received */
+        size_t got;
+};
+
+char *farm_path;
+int farm_workers = -1;          /* -f, local workers to spawn */
+int tile_cols = 64, tile_rows = 8;
+
+void farm_cleanup(void)
+{
+        unlink(farm_path);
+}
+
+pid_t farm_spawn(int nThreads)
+{
+        char count[16], exe[4096];
+        ssize_t len;
+        pid_t pid;
+
+        snprintf(count, sizeof(count), "%d", nThreads);
+        if ((len = readlink("/proc/self/exe", exe, sizeof(exe) - 1)) < 0) {
+                perror("readlink");
+                exit(1);
+        }
+        exe[len] = '\0';
+        pid = fork();
+        if (pid < 0) {
+                perror("fork");
+                exit(1);
+        }
+        if (pid == 0) {
+                execl(exe, "mandel", "--worker", farm_path, count, (char *)NULL);
+                perror("execl");
+                _exit(1);
+        }
+        return pid;
+}
+
+/* A worker went away: give its tile back unless another copy still runs */
+void farm_drop(struct farm_conn *c, struct farm_tile_state *tiles, int *first_todo,
+               int *reassigned)
+{
+        struct farm_tile_state *ts;
+
+        if (c->tile >= 0) {
+                ts = &tiles[c->tile];
+                if (ts->state == TILE_RUNNING && --ts->copies == 0) {
+                        ts->state = TILE_TODO;
+                        if (c->tile < *first_todo)
+                                *first_todo = c->tile;
+                        (*reassigned)++;
                 }
         }
+        close(c->fd);
+        free(c->buf);
+        c->fd = -1;
+}
+
+void render_farm(int nThreads)
+{
+        struct farm_tile_state *tiles, *ts;
+        struct farm_conn conns[FARM_MAX_CONNS], *c;
+        struct pollfd pfds[FARM_MAX_CONNS + 1];
+        struct farm_setup setup;
+        struct farm_result *res;
+        int *image, *band_done;
+        pid_t *spawned;
+        int ntiles, nbands, tiles_per_band, ndone = 0, next_band = 0, first_todo = 0;
+        int reassigned = 0, copies = 0, duplicates = 0, waiting_noted = 0, accepted = 0;
+        int i, j, r, id, lfd, npfds, nconns, best;
+        double now, sum_time = 0, elapsed, longest;
+        size_t need, buf_len;
+        ssize_t ret;
 
         /*
-         * Wait for all threads to terminate
+         * Cut the viewport into tiles, band by band
          */
+        tiles_per_band = (x_chars + tile_cols - 1) / tile_cols;
+        nbands = (y_chars + tile_rows - 1) / tile_rows;
+        ntiles = nbands * tiles_per_band;
+        tiles = safe_malloc(ntiles * sizeof(*tiles));
+        band_done = safe_malloc(nbands * sizeof(*band_done));
+        memset(band_done, 0, nbands * sizeof(*band_done));
+        for (i = 0; i < ntiles; i++) {
+                ts = &tiles[i];
+                ts->t.id = i;
+                ts->t.row0 = i / tiles_per_band * tile_rows;
+                ts->t.nrows = y_chars - ts->t.row0 < tile_rows ? y_chars - ts->t.row0 : tile_rows;
+                ts->t.col0 = i % tiles_per_band * tile_cols;
+                ts->t.ncols = x_chars - ts->t.col0 < tile_cols ? x_chars - ts->t.col0 : tile_cols;
+                ts->t.max_iter = MANDEL_MAX_ITERATION;
+                ts->state = TILE_TODO;
+                ts->copies = 0;
+        }
+        image = safe_malloc((size_t)x_chars * y_chars * sizeof(*image));
+        buf_len = sizeof(*res) + (size_t)tile_rows * tile_cols * sizeof(*image);
 
-        for (i = 0; i < nThreads; i++) {
-                sem_destroy(&semaphores[i]);
-                ret = pthread_join(thr[i].tid, NULL);
-                if (ret) {
-                        perror_pthread(ret, "pthread_join");
+        setup.xmin = view.xmin;
+        setup.ymax = view.ymax;
+        setup.xstep = view.xstep;
+        setup.ystep = view.ystep;
+        setup.xmin_lo = view.xmin_lo;
+        setup.ymax_lo = view.ymax_lo;
+        setup.dd = view.dd;
+        setup.kernel = kernel - fractal_kernels;
+        setup.cr = view.cr;
+        setup.ci = view.ci;
+
+        if ((lfd = farm_listen(farm_path)) < 0) {
+                perror(farm_path);
+                exit(1);
+        }
+        atexit(farm_cleanup);
+        signal(SIGPIPE, SIG_IGN);
+        spawned = safe_malloc((farm_workers + 1) * sizeof(*spawned));
+        for (i = 0; i < farm_workers; i++)
+                spawned[i] = farm_spawn(nThreads);
+        for (i = 0; i < FARM_MAX_CONNS; i++)
+                conns[i].fd = -1;
+
+        while (ndone < ntiles) {
+                /*
+                 * Hand out work to the idle workers
+                 */
+                now = now_sec();
+                for (i = 0, c = conns; i < FARM_MAX_CONNS; i++, c++) {
+                        if (c->fd < 0 || c->tile >= 0)
+                                continue;
+                        while (first_todo < ntiles && tiles[first_todo].state != TILE_TODO)
+                                first_todo++;
+                        if (first_todo < ntiles) {
+                                ts = &tiles[first_todo];
+                                ts->state = TILE_RUNNING;
+                                ts->start = now;
+                        } else {
+                                /* Nothing left: back up the worst straggler */
+                                best = -1;
+                                longest = ndone ? 3 * sum_time / ndone : -1;
+                                for (j = 0; j < ntiles && longest >= 0; j++) {
+                                        ts = &tiles[j];
+                                        elapsed = now - ts->start;
+                                        if (ts->state == TILE_RUNNING &&
+                                            ts->copies < FARM_MAX_COPIES && elapsed > longest) {
+                                                best = j;
+                                                longest = elapsed;
+                                        }
+                                }
+                                if (best < 0)
+                                        continue;
+                                ts = &tiles[best];
+                                copies++;
+                        }
+                        ts->copies++;
+                        c->tile = ts->t.id;
+                        if (insist_write(c->fd, (char *)&ts->t, sizeof(ts->t)) != sizeof(ts->t))
+                                farm_drop(c, tiles, &first_todo, &reassigned);
+                }
+
+                /*
+                 * Wait for new workers and results
+                 */
+                pfds[0].fd = lfd;
+                pfds[0].events = POLLIN;
+                for (i = 0, npfds = 1, nconns = 0; i < FARM_MAX_CONNS; i++) {
+                        pfds[npfds].fd = conns[i].fd;
+                        pfds[npfds].events = POLLIN;
+                        npfds++;
+                        if (conns[i].fd >= 0)
+                                nconns++;
+                }
+                /* Only worth saying when nobody is on the way */
+                if (nconns == 0 && !waiting_noted && (farm_workers == 0 || accepted)) {
+                        fprintf(stderr, "Waiting for workers on %s\n", farm_path);
+                        waiting_noted = 1;
+                }
+                if (poll(pfds, npfds, 50) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("poll");
                         exit(1);
                 }
+                while (waitpid(-1, NULL, WNOHANG) > 0)
+                        ;
+
+                if (pfds[0].revents & POLLIN) {
+                        for (i = 0; i < FARM_MAX_CONNS && conns[i].fd >= 0; i++)
+                                ;
+                        r = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+                        if (r >= 0 && i == FARM_MAX_CONNS)
+                                close(r);
+                        else if (r >= 0) {
+                                c = &conns[i];
+                                c->fd = r;
+                                c->tile = -1;
+                                c->got = 0;
+                                c->buf = safe_malloc(buf_len);
+                                waiting_noted = 0;
+                                accepted++;
+                                if (insist_write(r, (char *)&setup, sizeof(setup)) != sizeof(setup))
+                                        farm_drop(c, tiles, &first_todo, &reassigned);
+                        }
+                }
+
+                for (i = 0, c = conns; i < FARM_MAX_CONNS; i++, c++) {
+                        if (c->fd < 0 || !(pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                                continue;
+
+                        /* The header says how much follows */
+                        res = (struct farm_result *)c->buf;
+                        need = sizeof(*res);
+                        if (c->got >= sizeof(*res))
+                                need += (size_t)res->nrows * res->ncols * sizeof(*image);
+                        ret = read(c->fd, c->buf + c->got, need - c->got);
+                        if (ret < 0 && errno == EINTR)
+                                continue;
+                        if (ret <= 0 || c->tile < 0) {
+                                farm_drop(c, tiles, &first_todo, &reassigned);
+                                continue;
+                        }
+                        c->got += ret;
+                        if (c->got == sizeof(*res)) {
+                                ts = &tiles[c->tile];
+                                if (res->id != c->tile || res->nrows != ts->t.nrows ||
+                                    res->ncols != ts->t.ncols) {
+                                        fprintf(stderr, "Bad result from a worker, dropping it\n");
+                                        farm_drop(c, tiles, &first_todo, &reassigned);
+                                        continue;
+                                }
+                        }
+                        if (c->got < sizeof(*res) || c->got < sizeof(*res) +
+                            (size_t)res->nrows * res->ncols * sizeof(*image))
+                                continue;
+
+                        /* A complete result */
+                        id = c->tile;
+                        ts = &tiles[id];
+                        ts->copies--;
+                        c->tile = -1;
+                        c->got = 0;
+                        if (ts->state == TILE_DONE) {
+                                duplicates++;
+                                continue;
+                        }
+                        for (r = 0; r < ts->t.nrows; r++)
+                                memcpy(&image[(ts->t.row0 + r) * x_chars + ts->t.col0],
+                                       (int *)(res + 1) + r * ts->t.ncols,
+                                       ts->t.ncols * sizeof(*image));
+                        ts->state = TILE_DONE;
+                        sum_time += now_sec() - ts->start;
+                        ndone++;
+                        band_done[id / tiles_per_band]++;
+                }
+
+                /* Output every band that is now complete, in order */
+                for (; next_band < nbands && band_done[next_band] == tiles_per_band; next_band++)
+                        for (r = next_band * tile_rows;
+                             r < y_chars && r < (next_band + 1) * tile_rows; r++)
+                                output_mandel_line(1, &image[r * x_chars]);
         }
 
-        reset_xterm_color(1);
+        /* Closing the connections tells the workers to exit */
+        for (i = 0; i < FARM_MAX_CONNS; i++)
+                if (conns[i].fd >= 0) {
+                        close(conns[i].fd);
+                        free(conns[i].buf);
+                }
+        close(lfd);
+
+        /*
+         * The image is complete, so a local worker that is still busy
+         * can only be rendering a copy nobody needs, or be stuck.
+         */
+        for (i = 0; i < farm_workers; i++)
+                kill(spawned[i], SIGKILL);
+        while (waitpid(-1, NULL, 0) > 0)
+                ;
+        free(spawned);
+
+        if (verbose)
+                fprintf(stderr, "%d tiles, %d handed out again after a worker left, "
+                        "%d straggler copies, %d late duplicates\n",
+                        ntiles, reassigned, copies, duplicates);
+        free(tiles);
+        free(band_done);
+        free(image);
+}
+
+
+/*
+ * Time-budgeted rendering (-B). Every tile is first probed: one point
+ * in PROBE_STRIDE x PROBE_STRIDE at only PROBE_ITER iterations, through
+ * the same batch kernel as the render. The probe rate tells how many
+ * iterations the remaining time buys, and the probe of a tile
+ * estimates what a limit would cost: points that escaped cost what
+ * they did, points that hit the cap cost the limit.
+ *
+ * Tiles where some points escaped late or hit the cap next to ones
+ * that escaped are on the boundary: that is where a higher limit
+ * changes the picture. Their limits are doubled, most uncertain tile
+ * first, for as long as the estimate stays within budget. Tiles that
+ * are all inside or all outside keep PROBE_ITER.
+ *
+ * The render then goes in rounds. Each round renders its tiles most
+ * uncertain first, measures the rate it actually got, and counts
+ * every point of them to plan the next round: while time is left,
+ * the limits of the tiles that are still uncertain are raised again
+ * and those tiles rendered anew. Past the deadline, the rows that
+ * were never rendered are filled in from the probe; rows of an
+ * earlier round stay. A point that reaches its tile's limit is drawn
+ * as inside the set.
+ */
+#define PROBE_STRIDE    4
+#define PROBE_ITER      64
+#define BUDGET_SHARE    0.8     /* Of the remaining time, for the estimates */
+
+struct budget_tile {
+        int row0, nrows, col0, ncols;
+        int pcols, prows;       /* Probe grid */
+        int *probe;             /* Probe iteration counts */
+        long esc_iters;         /* Spent on escaping points */
+        int escaped, capped, late;      /* Of the probe, then of the last render */
+        int rendered;           /* The counts above are of the whole tile */
+        double uncertainty;
+        int limit;
+        int raised;             /* Limit raised in this round of planning */
+        int fallback;           /* Filled in from the probe */
+};
+
+long budget_ms = -1;            /* -B */
+struct budget_tile *btiles;
+int nbtiles;
+int *border;                    /* Tile indices, most uncertain first */
+int *btodo;                     /* Tiles to render this round */
+int nbtodo;
+struct mandel_iterbuf bimage;   /* Iteration counts of the whole image */
+double bdeadline;
+volatile int bnext = 0;
+volatile long biters = 0;
+double bbusy;                   /* Longest time a worker computed */
+pthread_mutex_t bbusy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Note the time one worker spent computing, for the rate */
+void budget_note_busy(double t)
+{
+        pthread_mutex_lock(&bbusy_mutex);
+        if (t > bbusy)
+                bbusy = t;
+        pthread_mutex_unlock(&bbusy_mutex);
+}
+
+/* Count the counts of n points rendered with the given limit */
+void budget_count(struct budget_tile *bt, const int *iters, int n, int limit)
+{
+        int i;
+
+        for (i = 0; i < n; i++) {
+                if (iters[i] >= limit) {
+                        bt->capped++;
+                } else {
+                        bt->escaped++;
+                        bt->esc_iters += iters[i];
+                        if (iters[i] >= limit / 2)
+                                bt->late++;
+                }
+        }
+}
+
+void *budget_probe_worker(void *arg)
+{
+        struct thread_info_struct *thr = arg;
+        struct budget_tile *bt;
+        double start;
+        double *cols = safe_malloc(tile_cols * tile_rows * sizeof(*cols));
+        double *rows = safe_malloc(tile_cols * tile_rows * sizeof(*rows));
+        long iters = 0;
+        int i, j, n;
+
+        topo_bind_self(thr->cpu);
+        start = now_sec();
+
+        while ((i = __sync_fetch_and_add(&bnext, 1)) < nbtiles) {
+                bt = &btiles[i];
+                n = bt->prows * bt->pcols;
+                for (j = 0; j < n; j++) {
+                        cols[j] = bt->col0 + j % bt->pcols * PROBE_STRIDE;
+                        rows[j] = bt->row0 + j / bt->pcols * PROBE_STRIDE;
+                }
+                mandel_ctx_batch(&view, cols, rows, n, PROBE_ITER, bt->probe);
+                for (j = 0; j < n; j++)
+                        iters += bt->probe[j];
+                budget_count(bt, bt->probe, n, PROBE_ITER);
+        }
+        budget_note_busy(now_sec() - start);
+        __sync_fetch_and_add(&biters, iters);
+        free(cols);
+        free(rows);
+        return NULL;
+}
+
+/*
+ * Estimated iterations to render the whole tile with the given limit.
+ * From a probe, one more point, one the probe did not see, may just
+ * as well run into the limit.
+ */
+double budget_cost(struct budget_tile *bt, int limit)
+{
+        double n = bt->escaped + bt->capped;
+
+        return (double)bt->nrows * bt->ncols / n *
+                (bt->esc_iters + (double)(bt->capped + !bt->rendered) * limit);
+}
+
+/* Fill in the rows from r0 on from the probe, nearest probe point */
+void budget_fill_from_probe(struct budget_tile *bt, int r0)
+{
+        int r, c, it;
+
+        for (r = r0; r < bt->nrows; r++)
+                for (c = 0; c < bt->ncols; c++) {
+                        it = bt->probe[r / PROBE_STRIDE * bt->pcols + c / PROBE_STRIDE];
+                        mandel_iterbuf_set(&bimage,
+                                (size_t)(bt->row0 + r) * x_chars + bt->col0 + c,
+                                it >= PROBE_ITER ? MANDEL_MAX_ITERATION : it);
+                }
+        bt->fallback = 1;
+}
+
+void *budget_render_worker(void *arg)
+{
+        struct thread_info_struct *thr = arg;
+        struct budget_tile *bt, counts;
+        double start;
+        long iters = 0;
+        int i, r, c;
+        int *row = safe_malloc(tile_cols * sizeof(*row));
+
+        topo_bind_self(thr->cpu);
+        start = now_sec();
+
+        while ((i = __sync_fetch_and_add(&bnext, 1)) < nbtodo) {
+                bt = &btiles[btodo[i]];
+                memset(&counts, 0, sizeof(counts));
+                for (r = 0; r < bt->nrows; r++) {
+                        if (now_sec() > bdeadline) {
+                                if (!bt->rendered)
+                                        budget_fill_from_probe(bt, r);
+                                break;
+                        }
+                        compute_iterations_span(bt->row0 + r, bt->col0, bt->ncols,
+                                                bt->limit, row);
+                        budget_count(&counts, row, bt->ncols, bt->limit);
+                        for (c = 0; c < bt->ncols; c++) {
+                                iters += row[c];
+                                if (row[c] >= bt->limit)
+                                        row[c] = MANDEL_MAX_ITERATION;
+                        }
+                        mandel_iterbuf_put(&bimage, (size_t)(bt->row0 + r) * x_chars + bt->col0,
+                                           row, bt->ncols);
+                }
+                if (r == bt->nrows) {
+                        bt->escaped = counts.escaped;
+                        bt->capped = counts.capped;
+                        bt->late = counts.late;
+                        bt->esc_iters = counts.esc_iters;
+                        bt->rendered = 1;
+                }
+        }
+        budget_note_busy(now_sec() - start);
+        __sync_fetch_and_add(&biters, iters);
+        free(row);
+        return NULL;
+}
+
+static int by_uncertainty(const void *a, const void *b)
+{
+        const struct budget_tile *ta = &btiles[*(const int *)a];
+        const struct budget_tile *tb = &btiles[*(const int *)b];
+
+        if (ta->uncertainty != tb->uncertainty)
+                return ta->uncertainty < tb->uncertainty ? 1 : -1;
+        return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Raise the limits of the uncertain tiles within what rate buys in the
+ * time left, and list the tiles to render in btodo. The first round
+ * renders all tiles, the next ones only those with a raised limit.
+ */
+void budget_plan(double rate, int first)
+{
+        struct budget_tile *bt;
+        double budget, planned = 0, extra, n;
+        int i, raised;
+
+        budget = rate * (bdeadline - now_sec()) * BUDGET_SHARE;
+        for (i = 0; i < nbtiles; i++) {
+                bt = &btiles[i];
+                n = bt->escaped + bt->capped;
+                bt->uncertainty = (double)bt->late / n +
+                        (double)bt->capped * bt->escaped / (n * n);
+                /* With every point escaped, a higher limit changes nothing */
+                if (bt->rendered && bt->capped == 0)
+                        bt->uncertainty = 0;
+                border[i] = i;
+        }
+        qsort(border, nbtiles, sizeof(*border), by_uncertainty);
+
+        /* In later rounds, a tile is only rendered again if it gets raised */
+        for (i = 0; i < nbtiles; i++) {
+                btiles[i].raised = 0;
+                if (first)
+                        planned += budget_cost(&btiles[i], btiles[i].limit);
+        }
+
+        do {
+                raised = 0;
+                for (i = 0; i < nbtiles; i++) {
+                        bt = &btiles[border[i]];
+                        if (bt->uncertainty == 0 || bt->limit >= MANDEL_MAX_ITERATION)
+                                continue;
+                        if (!first && !bt->raised)
+                                extra = budget_cost(bt, 2 * bt->limit);
+                        else
+                                extra = budget_cost(bt, 2 * bt->limit) -
+                                        budget_cost(bt, bt->limit);
+                        if (planned + extra > budget)
+                                continue;
+                        planned += extra;
+                        bt->limit *= 2;
+                        if (bt->limit > MANDEL_MAX_ITERATION)
+                                bt->limit = MANDEL_MAX_ITERATION;
+                        bt->raised = 1;
+                        raised = 1;
+                }
+        } while (raised);
+
+        nbtodo = 0;
+        for (i = 0; i < nbtiles; i++) {
+                bt = &btiles[border[i]];
+                if (first || bt->raised)
+                        btodo[nbtodo++] = border[i];
+        }
+}
+
+void render_budgeted(int nThreads)
+{
+        struct budget_tile *bt;
+        int tiles_per_band, i, rounds = 0, nfallback = 0, nraised = 0, max_limit = PROBE_ITER;
+        double start, rate;
+        int *color_val;
+
+        start = now_sec();
+        bdeadline = start + budget_ms / 1000.0;
+
+        tiles_per_band = (x_chars + tile_cols - 1) / tile_cols;
+        nbtiles = (y_chars + tile_rows - 1) / tile_rows * tiles_per_band;
+        btiles = safe_malloc(nbtiles * sizeof(*btiles));
+        border = safe_malloc(nbtiles * sizeof(*border));
+        btodo = safe_malloc(nbtiles * sizeof(*btodo));
+        memset(btiles, 0, nbtiles * sizeof(*btiles));
+        for (i = 0; i < nbtiles; i++) {
+                bt = &btiles[i];
+                bt->row0 = i / tiles_per_band * tile_rows;
+                bt->nrows = y_chars - bt->row0 < tile_rows ? y_chars - bt->row0 : tile_rows;
+                bt->col0 = i % tiles_per_band * tile_cols;
+                bt->ncols = x_chars - bt->col0 < tile_cols ? x_chars - bt->col0 : tile_cols;
+                bt->prows = (bt->nrows + PROBE_STRIDE - 1) / PROBE_STRIDE;
+                bt->pcols = (bt->ncols + PROBE_STRIDE - 1) / PROBE_STRIDE;
+                bt->probe = safe_malloc(bt->prows * bt->pcols * sizeof(*bt->probe));
+                bt->limit = PROBE_ITER;
+        }
+        if (mandel_iterbuf_init(&bimage, (size_t)x_chars * y_chars,
+                                MANDEL_MAX_ITERATION, NULL) < 0) {
+                fprintf(stderr, "Out of memory for the iteration buffer\n");
+                exit(1);
+        }
+
+        /*
+         * Probe, then render in rounds for as long as there is time
+         * and a tile to raise. The rate is per second of computing,
+         * so starting the threads does not count against it.
+         */
+        run_workers(nThreads, budget_probe_worker);
+        rate = biters / (bbusy + 1e-6);
+        budget_plan(rate, 1);
+        while (nbtodo > 0 && now_sec() < bdeadline) {
+                bnext = 0;
+                biters = 0;
+                bbusy = 0;
+                run_workers(nThreads, budget_render_worker);
+                rounds++;
+                if (biters > 0)
+                        rate = biters / (bbusy + 1e-6);
+                budget_plan(rate, 0);
+        }
+
+        color_val = safe_malloc(x_chars * sizeof(*color_val));
+        for (i = 0; i < y_chars; i++) {
+                mandel_iterbuf_fetch(&bimage, (size_t)i * x_chars, color_val, x_chars);
+                color_span(x_chars, color_val);
+                output_mandel_line(1, color_val);
+        }
+        free(color_val);
+
+        for (i = 0; i < nbtiles; i++) {
+                bt = &btiles[i];
+                nfallback += bt->fallback;
+                nraised += bt->limit > PROBE_ITER;
+                if (bt->limit > max_limit)
+                        max_limit = bt->limit;
+                free(bt->probe);
+        }
+        if (verbose)
+                fprintf(stderr, "Budget %ldms: %d tiles in %d rounds, %d with a raised limit "
+                        "(up to %d), %d (partly) filled in from the probe, done in %.0fms\n",
+                        budget_ms, nbtiles, rounds, nraised, max_limit, nfallback,
+                        (now_sec() - start) * 1000);
+        free(btiles);
+        free(border);
+        free(btodo);
+        mandel_iterbuf_destroy(&bimage);
+}
+
+
+/*
+ * Adaptive supersampling (-s k). The image is first rendered with one
+ * sample per point. Points whose iteration count differs from one of
+ * their 8 neighbours lie on an edge of the picture; only these are
+ * rendered again with k x k samples spread over the character cell,
+ * through the batch kernel, and drawn in the xterm color closest to
+ * the average of their samples. Counts above 255 all get the same
+ * color, so they count as equal.
+ */
+#define SS_CHUNK        16      /* Edge points claimed at a time */
+
+int ss_k = 0;                   /* -s */
+struct mandel_iterbuf ss_iters; /* One sample per point */
+int *ss_colors;
+int *ss_edges;                  /* Indices of the edge points */
+int ss_nedges;
+volatile int ss_next = 0;
+
+void *ss_first_pass(void *arg)
+{
+        struct thread_info_struct *thr = arg;
+        int row;
+        int *iters = safe_malloc(x_chars * sizeof(*iters));
+
+        topo_bind_self(thr->cpu);
+
+        while ((row = __sync_fetch_and_add(&ss_next, 1)) < y_chars) {
+                compute_iterations_span(row, 0, x_chars, MANDEL_MAX_ITERATION, iters);
+                mandel_iterbuf_put(&ss_iters, (size_t)row * x_chars, iters, x_chars);
+        }
+        free(iters);
+        return NULL;
+}
+
+void *ss_edge_pass(void *arg)
+{
+        struct thread_info_struct *thr = arg;
+        int n = ss_k * ss_k;
+        double sx[n], sy[n];
+        int samples[n];
+        int i, j, end, p, row, col;
+
+        topo_bind_self(thr->cpu);
+
+        while ((i = __sync_fetch_and_add(&ss_next, SS_CHUNK)) < ss_nedges) {
+                end = i + SS_CHUNK < ss_nedges ? i + SS_CHUNK : ss_nedges;
+                for (; i < end; i++) {
+                        p = ss_edges[i];
+                        row = p / x_chars;
+                        col = p % x_chars;
+                        for (j = 0; j < n; j++) {
+                                sx[j] = col + (j % ss_k + 0.5) / ss_k - 0.5;
+                                sy[j] = row + (j / ss_k + 0.5) / ss_k - 0.5;
+                        }
+                        mandel_ctx_batch(&view, sx, sy, n, MANDEL_MAX_ITERATION, samples);
+                        ss_colors[p] = xterm_color_blend(samples, n);
+                }
+        }
+        return NULL;
+}
+
+static int ss_level(int iters)
+{
+        return iters > 255 ? 255 : iters;
+}
+
+void render_supersampled(int nThreads)
+{
+        int row, col, dr, dc, r, c, p, edge, level;
+        long npoints = (long)x_chars * y_chars, samples;
+
+        if (mandel_iterbuf_init(&ss_iters, npoints, MANDEL_MAX_ITERATION, NULL) < 0) {
+                fprintf(stderr, "Out of memory for the iteration buffer\n");
+                exit(1);
+        }
+        ss_colors = safe_malloc(npoints * sizeof(*ss_colors));
+        ss_edges = safe_malloc(npoints * sizeof(*ss_edges));
+
+        run_workers(nThreads, ss_first_pass);
+
+        /* Find the edges, color everything else right away */
+        for (row = 0; row < y_chars; row++)
+                for (col = 0; col < x_chars; col++) {
+                        p = row * x_chars + col;
+                        level = ss_level(mandel_iterbuf_get(&ss_iters, p));
+                        edge = 0;
+                        for (dr = -1; dr <= 1 && !edge; dr++)
+                                for (dc = -1; dc <= 1; dc++) {
+                                        r = row + dr;
+                                        c = col + dc;
+                                        if (r < 0 || r >= y_chars || c < 0 || c >= x_chars)
+                                                continue;
+                                        if (ss_level(mandel_iterbuf_get(&ss_iters,
+                                                                        r * x_chars + c)) != level) {
+                                                edge = 1;
+                                                break;
+                                        }
+                                }
+                        if (edge)
+                                ss_edges[ss_nedges++] = p;
+                        else
+                                ss_colors[p] = xterm_color(level);
+                }
+
+        ss_next = 0;
+        run_workers(nThreads, ss_edge_pass);
+
+        for (row = 0; row < y_chars; row++)
+                output_mandel_line(1, &ss_colors[row * x_chars]);
+
+        samples = npoints + (long)ss_nedges * ss_k * ss_k;
+        if (verbose)
+                fprintf(stderr, "Supersampled %d of %ld points %dx%d: %ld samples, "
+                        "%ld for uniform %dx%d (%.1f%%)\n",
+                        ss_nedges, npoints, ss_k, ss_k, samples,
+                        npoints * ss_k * ss_k, ss_k, ss_k,
+                        100.0 * samples / (npoints * ss_k * ss_k));
+        mandel_iterbuf_destroy(&ss_iters);
+        free(ss_colors);
+        free(ss_edges);
+}
+
+
+/*
+ * Streaming rendering to a file (-o), for images larger than memory.
+ * The image is cut into bands of whole rows, sized so that the bands
+ * in flight fit the memory budget (-M). There are twice as many band
+ * slots as threads: a thread takes the next band, waits until its
+ * slot has been written out, and renders into it. The main thread
+ * encodes and writes the bands in order and hands the slots back.
+ * Memory stays the same however tall the image is.
+ */
+enum { OUT_PGM, OUT_PPM, OUT_RAW };
+
+struct band_slot {
+        int band;               /* Band this slot is for next */
+        int ready;              /* Rendered, waiting to be written */
+        int *iters;
+};
+
+char *out_path = NULL;          /* -o */
+int out_format;
+long mem_budget_mb = 64;        /* -M */
+struct band_slot *slots;
+int nslots, band_rows, nbands;
+volatile int next_band = 0;
+pthread_mutex_t band_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t band_ready = PTHREAD_COND_INITIALIZER;
+pthread_cond_t slot_free = PTHREAD_COND_INITIALIZER;
+
+void *band_worker(void *arg)
+{
+        struct thread_info_struct *thr = arg;
+        struct band_slot *slot;
+        int b, r, row0;
+
+        topo_bind_self(thr->cpu);
+
+        while ((b = __sync_fetch_and_add(&next_band, 1)) < nbands) {
+                slot = &slots[b % nslots];
+                pthread_mutex_lock(&band_mutex);
+                while (slot->band != b)
+                        pthread_cond_wait(&slot_free, &band_mutex);
+                pthread_mutex_unlock(&band_mutex);
+
+                row0 = b * band_rows;
+                for (r = 0; r < band_rows && row0 + r < y_chars; r++)
+                        compute_iterations_span(row0 + r, 0, x_chars, MANDEL_MAX_ITERATION,
+                                                &slot->iters[(size_t)r * x_chars]);
+
+                pthread_mutex_lock(&band_mutex);
+                slot->ready = 1;
+                pthread_cond_broadcast(&band_ready);
+                pthread_mutex_unlock(&band_mutex);
+        }
+        return NULL;
+}
+
+/* Encode one row of iteration counts into buf, returns its length */
+size_t encode_row(const int *iters, unsigned char *buf)
+{
+        int i;
+
+        switch (out_format) {
+        case OUT_PGM:
+                for (i = 0; i < x_chars; i++)
+                        buf[i] = iters[i] > 255 ? 255 : iters[i];
+                return x_chars;
+        case OUT_PPM:
+                for (i = 0; i < x_chars; i++)
+                        mandel_palette_rgb(iters[i], &buf[3 * i]);
+                return 3 * x_chars;
+        default:
+                memcpy(buf, iters, x_chars * sizeof(*iters));
+                return x_chars * sizeof(*iters);
+        }
+}
+
+void render_streaming(int nThreads)
+{
+        struct thread_info_struct *thr;
+        struct band_slot *slot;
+        size_t row_bytes, len;
+        unsigned char *buf;
+        char header[64];
+        struct rusage ru;
+        const char *ext;
+        int i, b, r, fd;
+
+        ext = strrchr(out_path, '.');
+        if (ext && strcmp(ext, ".pgm") == 0)
+                out_format = OUT_PGM;
+        else if (ext && strcmp(ext, ".ppm") == 0)
+                out_format = OUT_PPM;
+        else
+                out_format = OUT_RAW;
+
+        nslots = 2 * nThreads;
+        row_bytes = (size_t)x_chars * sizeof(int);
+        band_rows = mem_budget_mb * 1024 * 1024 / (nslots * row_bytes);
+
+        /* Small images still need a few bands per thread */
+        if (band_rows > y_chars / (2 * nslots))
+                band_rows = y_chars / (2 * nslots);
+        if (band_rows < 1)
+                band_rows = 1;
+        nbands = (y_chars + band_rows - 1) / band_rows;
+        slots = safe_malloc(nslots * sizeof(*slots));
+        for (i = 0; i < nslots; i++) {
+                slots[i].band = i;
+                slots[i].ready = 0;
+                slots[i].iters = safe_malloc(band_rows * row_bytes);
+        }
+        buf = safe_malloc(row_bytes > 3 * x_chars ? row_bytes : 3 * x_chars);
+
+        fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+                perror(out_path);
+                exit(1);
+        }
+        if (out_format != OUT_RAW) {
+                len = snprintf(header, sizeof(header), "P%c\n%d %d\n255\n",
+                               out_format == OUT_PGM ? '5' : '6', x_chars, y_chars);
+                if (insist_write(fd, header, len) != len) {
+                        perror(out_path);
+                        exit(1);
+                }
+        }
+
+        /* The workers render in the background, this thread writes */
+        thr = start_workers(nThreads, band_worker);
+
+        for (b = 0; b < nbands; b++) {
+                slot = &slots[b % nslots];
+                pthread_mutex_lock(&band_mutex);
+                while (!slot->ready)
+                        pthread_cond_wait(&band_ready, &band_mutex);
+                pthread_mutex_unlock(&band_mutex);
+
+                for (r = 0; r < band_rows && b * band_rows + r < y_chars; r++) {
+                        len = encode_row(&slot->iters[(size_t)r * x_chars], buf);
+                        if (insist_write(fd, (char *)buf, len) != len) {
+                                perror(out_path);
+                                exit(1);
+                        }
+                }
+
+                pthread_mutex_lock(&band_mutex);
+                slot->ready = 0;
+                slot->band = b + nslots;
+                pthread_cond_broadcast(&slot_free);
+                pthread_mutex_unlock(&band_mutex);
+        }
+
+        join_workers(thr, nThreads);
+        if (close(fd) < 0) {
+                perror(out_path);
+                exit(1);
+        }
+
+        if (verbose) {
+                getrusage(RUSAGE_SELF, &ru);
+                fprintf(stderr, "%d bands of %d rows, %d in flight, peak RSS %ld kB\n",
+                        nbands, band_rows, nslots, ru.ru_maxrss);
+        }
+        for (i = 0; i < nslots; i++)
+                free(slots[i].iters);
+        free(slots);
+        free(buf);
+}
+
+
+/*
+ * Concurrent renders in one shared pool (-z n): n zoom levels into the
+ * seahorse valley, each 4 times deeper than the one before, as a server
+ * would render them for several clients. The outermost is the most
+ * urgent. They are submitted the other way round, so it is the priority
+ * and not the arrival order that decides who gets the threads. The
+ * levels past MANDEL_DD_THRESHOLD render in double-double.
+ */
+#define ZOOM_X  -0.743643887037151
+#define ZOOM_Y  0.131825904205330
+
+int nzooms = 0;                 /* -z */
+
+void render_zooms(int nThreads)
+{
+        struct mandel_ctx *ctxs;
+        struct mandel_pool pool;
+        struct fractal_dd zx = { ZOOM_X, 0 }, zy = { ZOOM_Y, 0 };
+        double start, w, h;
+        int i, row, ret;
+        int *color_val;
+
+        ctxs = safe_malloc(nzooms * sizeof(*ctxs));
+        w = (xmax - xmin) / 2;
+        h = (ymax - ymin) / 2;
+        for (i = 0; i < nzooms; i++, w /= 4, h /= 4) {
+                mandel_ctx_init_dd(&ctxs[i], fractal_dd_add(zx, -w), fractal_dd_add(zy, h),
+                                   2 * w, 2 * h, x_chars, y_chars, MANDEL_MAX_ITERATION);
+                ctxs[i].kernel = kernel;
+                if (mandel_ctx_alloc(&ctxs[i]) < 0) {
+                        fprintf(stderr, "Out of memory for the iteration buffers\n");
+                        exit(1);
+                }
+                ctxs[i].priority = nzooms - i;
+        }
+
+        if ((ret = mandel_pool_init(&pool, nThreads))) {
+                perror_pthread(ret, "mandel_pool_init");
+                exit(1);
+        }
+        start = now_sec();
+        for (i = nzooms - 1; i >= 0; i--)
+                mandel_pool_submit(&pool, &ctxs[i]);
+
+        color_val = safe_malloc(x_chars * sizeof(*color_val));
+        for (i = 0; i < nzooms; i++) {
+                mandel_pool_wait(&pool, &ctxs[i]);
+                if (verbose)
+                        fprintf(stderr, "Zoom %d (priority %d) done after %.3fs\n",
+                                i, ctxs[i].priority, now_sec() - start);
+                for (row = 0; row < y_chars; row++) {
+                        mandel_iterbuf_fetch(&ctxs[i].iters, (size_t)row * x_chars,
+                                             color_val, x_chars);
+                        color_span(x_chars, color_val);
+                        output_mandel_line(1, color_val);
+                }
+        }
+        free(color_val);
+
+        mandel_pool_destroy(&pool);
+        for (i = 0; i < nzooms; i++)
+                mandel_ctx_destroy(&ctxs[i]);
+        free(ctxs);
+}
+
+/*
+ * The part of the plane where the set is: Julia sets and the higher
+ * powers sit around the origin.
+ */
+void kernel_viewport(const struct fractal_kernel *k)
+{
+        if (!k->julia && k->power == 2)
+                return;
+        xmin = -1.6;
+        xmax = 1.6;
+        ymin = -1.2;
+        ymax = 1.2;
+}
+
+/*
+ * Time the scalar and the SIMD versions of every kernel on its own
+ * viewport, on one thread, and check that they agree point by point.
+ * The double-double versions run on the same points, to show what
+ * the precision costs.
+ */
+void bench_kernels(void)
+{
+        const struct fractal_kernel *k;
+        struct mandel_ctx ctx;
+        double *xs, *ys, *zeros, t0, t;
+        int *a, *b;
+        size_t i, n = (size_t)x_chars * y_chars;
+        char label[32];
+        long total;
+        int j, simd, diff;
+
+        xs = safe_malloc(n * sizeof(*xs));
+        ys = safe_malloc(n * sizeof(*ys));
+        zeros = safe_malloc(n * sizeof(*zeros));
+        memset(zeros, 0, n * sizeof(*zeros));
+        a = safe_malloc(n * sizeof(*a));
+        b = safe_malloc(n * sizeof(*b));
+
+        printf("%-9s %10s %10s", "kernel", "Miter", "scalar");
+        for (simd = 0; simd < FRACTAL_NSIMD; simd++)
+                printf(" %10s", fractal_simd_names[simd]);
+        printf("   (Miter/s, %dx%d points)\n", x_chars, y_chars);
+
+        for (j = 0; j < fractal_nkernels; j++) {
+                k = &fractal_kernels[j];
+                xmin = -1.8; xmax = 1.0; ymin = -1.0; ymax = 1.0;
+                kernel_viewport(k);
+                mandel_ctx_init(&ctx, xmin, xmax, ymin, ymax, x_chars, y_chars,
+                                MANDEL_MAX_ITERATION);
+                for (i = 0; i < n; i++) {
+                        xs[i] = ctx.xmin + ctx.xstep * (i % x_chars);
+                        ys[i] = ctx.ymax - ctx.ystep * (i / x_chars);
+                }
+                mandel_ctx_destroy(&ctx);
+
+                t0 = now_sec();
+                for (i = 0, total = 0; i < n; i++) {
+                        a[i] = k->scalar(xs[i], ys[i], julia_cr, julia_ci,
+                                         MANDEL_MAX_ITERATION);
+                        total += a[i];
+                }
+                t = now_sec() - t0;
+                printf("%-9s %10.1f %10.1f", k->name, total / 1e6, total / 1e6 / t);
+
+                for (simd = 0; simd < FRACTAL_NSIMD; simd++) {
+                        if (!fractal_simd_supported(simd)) {
+                                printf(" %10s", "-");
+                                continue;
+                        }
+                        t0 = now_sec();
+                        k->simd[simd](xs, ys, n, julia_cr, julia_ci,
+                                      MANDEL_MAX_ITERATION, b);
+                        t = now_sec() - t0;
+                        for (i = 0, diff = 0; i < n; i++)
+                                diff += a[i] != b[i];
+                        printf(" %10.1f", total / 1e6 / t);
+                        if (diff)
+                                printf(" (%d differ)", diff);
+                }
+                printf("\n");
+
+                if (!k->dd_scalar)
+                        continue;
+                t0 = now_sec();
+                for (i = 0, total = 0; i < n; i++) {
+                        a[i] = k->dd_scalar(xs[i], 0, ys[i], 0, julia_cr, julia_ci,
+                                            MANDEL_MAX_ITERATION);
+                        total += a[i];
+                }
+                t = now_sec() - t0;
+                snprintf(label, sizeof(label), "%s-dd", k->name);
+                printf("%-9s %10.1f %10.1f", label, total / 1e6, total / 1e6 / t);
+
+                for (simd = 0; simd < FRACTAL_NSIMD; simd++) {
+                        if (!fractal_simd_supported(simd)) {
+                                printf(" %10s", "-");
+                                continue;
+                        }
+                        t0 = now_sec();
+                        k->dd_simd[simd](xs, zeros, ys, zeros, n, julia_cr, julia_ci,
+                                         MANDEL_MAX_ITERATION, b);
+                        t = now_sec() - t0;
+                        for (i = 0, diff = 0; i < n; i++)
+                                diff += a[i] != b[i];
+                        printf(" %10.1f", total / 1e6 / t);
+                        if (diff)
+                                printf(" (%d differ)", diff);
+                }
+                printf("\n");
+        }
+        free(xs);
+        free(ys);
+        free(zeros);
+        free(a);
+        free(b);
+}
+
+void usage(char *argv0)
+{
+        fprintf(stderr, "Usage: %s [-pv] [-a policy] [-g colsxrows] [-k kernel [-j cr,ci]]\n"
+                "           [-C path [--resume]] [-B ms] [-s k] [-o file [-M mb]]\n"
+                "           [-f nworkers [-S path]] [-T colsxrows] [-z n]\n"
+                "           [-c cx,cy] [-w width] thread_count\n"
+                "       %s --worker path thread_count\n"
+                "       %s --bench [-g colsxrows] [-j cr,ci] thread_count\n\n"
+                "Exactly one argument required:\n"
+                "    thread_count: The number of threads to create.\n\n"
+                "Options:\n"
+                "    -a policy: Pin workers to CPUs by topology: none, same-core,\n"
+                "        same-socket, cross-socket or spread (default none).\n"
+                "    -B ms: Render within a time budget, raising the iteration\n"
+                "        limit only on the tiles where it matters.\n"
+                "    -c cx,cy: Center the view at cx + i cy (default the middle\n"
+                "        of the set). Give as many digits as the zoom needs.\n"
+                "    -C path: Render through a checkpoint file. SIGINT or SIGTERM\n"
+                "        stops the render after the rows in progress and keeps\n"
+                "        the file; it is removed once the image is out.\n"
+                "    --resume: Continue the render in the -C checkpoint file.\n"
+                "    -g colsxrows: Size of the output (default 90x50).\n"
+                "    -k kernel: The fractal: mandel, mandel3 or mandel4 for the\n"
+                "        Mandelbrot sets of z^2+c, z^3+c or z^4+c, julia, julia3\n"
+                "        or julia4 for their Julia sets (default mandel).\n"
+                "    -j cr,ci: The c of the Julia sets (default 0.1,0.55).\n"
+                "    -o file: Stream the image into file, band by band: PGM or\n"
+                "        PPM by its extension, otherwise raw int iteration counts.\n"
+                "    -M mb: Memory for the bands in flight with -o (default 64).\n"
+                "    -p: Fork thread_count worker processes instead of threads.\n"
+                "        They share the result buffer; the rows of a worker that\n"
+                "        crashes are computed again.\n"
+                "    -f nworkers: Act as a render farm coordinator: hand out tiles\n"
+                "        to the workers that connect to the Unix socket at path,\n"
+                "        after spawning nworkers local ones (0 for none). Each\n"
+                "        worker renders with thread_count threads.\n"
+                "    -s k: Antialias: render the points on edges again with k x k\n"
+                "        samples each.\n"
+                "    -S path: Socket of the render farm (default /tmp/mandel-farm.<pid>).\n"
+                "    -T colsxrows: Size of the -B and -f tiles (default 64x8).\n"
+                "    -v: Print the render time on stderr.\n"
+                "    -w width: Width of the view on the complex plane (default that\n"
+                "        of the whole set); the height follows. Below 1e-13 per\n"
+                "        point the mandel and julia kernels switch to double-double\n"
+                "        precision, good down to about 1e-28.\n"
+                "    -z n: Render n zoom levels at once in one shared thread pool,\n"
+                "        the outermost first.\n"
+                "    --worker path: Render tiles for the coordinator at path.\n"
+                "    --bench: Time the scalar and the SIMD versions of every kernel.\n",
+                argv0, argv0, argv0);
+        exit(1);
+}
+
+
+void render_threads(int nThreads)
+{
+        int i, ret;
+        struct thread_info_struct *thr;
+        sem_t *semaphores = safe_malloc(nThreads *sizeof(*semaphores));
+
+        sem_init(&semaphores[0], 0, 1); // output initiation thread (first)
+        for(i=1; i<nThreads; i++){
+            sem_init(&semaphores[i], 0, 0); // output threads block initially
+        }
+
+        thr = safe_malloc(nThreads * sizeof(*thr));
+
+        for(i=0; i<nThreads; i++){
+                /* Initialize per-thread structure */
+                thr[i].nThreads = nThreads;
+                thr[i].thrid = i;
+                thr[i].semaphores = semaphores;
+                thr[i].fd = 1;
+                thr[i].cpu = topo_place(&topo, placement, i, nThreads);
+
+                /* Spawn new thread */
+                ret = pthread_create(&thr[i].tid, NULL, compute_and_output_mandel_line, &thr[i]);
+                if (ret) {
+                    perror_pthread(ret, "pthread_create");
+                    exit(1);
+                }
+        }
+
+        /*
+         * Wait for all threads to terminate
+         */
+
+        for (i = 0; i < nThreads; i++) {
+                ret = pthread_join(thr[i].tid, NULL);
+                if (ret) {
+                        perror_pthread(ret, "pthread_join");
+                        exit(1);
+                }
+        }
+        for (i = 0; i < nThreads; i++)
+                sem_destroy(&semaphores[i]);
+        free(semaphores);
+        free(thr);
+}
+
+int main(int argc, char *argv[])
+{
+        static struct option long_opts[] = {
+                { "worker", required_argument, NULL, 'W' },
+                { "resume", no_argument, NULL, 'R' },
+                { "bench", no_argument, NULL, 'K' },
+                { NULL, 0, NULL, 0 }
+        };
+        char *worker_path = NULL;
+        const char *end;
+        struct fractal_dd x0, y0;
+        int nThreads, opt;
+        double start, view_height;
+
+        while ((opt = getopt_long(argc, argv, "a:B:c:C:f:g:j:k:M:o:ps:S:T:vw:z:", long_opts, NULL)) != -1) {
+                switch (opt) {
+                case 'a':
+                        if (topo_parse_policy(optarg, &placement) < 0) {
+                                fprintf(stderr, "`%s' is not a valid placement policy\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'g':
+                        if (sscanf(optarg, "%dx%d", &x_chars, &y_chars) != 2 ||
+                            x_chars <= 0 || y_chars <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `colsxrows'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'B':
+                        if (safe_atoi(optarg, &opt) < 0 || opt <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `ms'\n", optarg);
+                                exit(1);
+                        }
+                        budget_ms = opt;
+                        break;
+                case 'c':
+                        end = fractal_dd_parse(optarg, &center_x);
+                        if (end && *end == ',')
+                                end = fractal_dd_parse(end + 1, &center_y);
+                        if (!end || *end) {
+                                fprintf(stderr, "`%s' is not valid for `cx,cy'\n", optarg);
+                                exit(1);
+                        }
+                        have_center = 1;
+                        break;
+                case 'C':
+                        ckpt_path = optarg;
+                        break;
+                case 'f':
+                        if (safe_atoi(optarg, &farm_workers) < 0 || farm_workers < 0) {
+                                fprintf(stderr, "`%s' is not valid for `nworkers'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'j':
+                        if (sscanf(optarg, "%lf,%lf", &julia_cr, &julia_ci) != 2) {
+                                fprintf(stderr, "`%s' is not valid for `cr,ci'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'k':
+                        if ((kernel = fractal_find(optarg)) == NULL) {
+                                fprintf(stderr, "`%s' is not a known kernel\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'K':
+                        bench = 1;
+                        break;
+                case 'M':
+                        if (safe_atoi(optarg, &opt) < 0 || opt <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `mb'\n", optarg);
+                                exit(1);
+                        }
+                        mem_budget_mb = opt;
+                        break;
+                case 'o':
+                        out_path = optarg;
+                        break;
+                case 'p':
+                        use_processes = 1;
+                        break;
+                case 's':
+                        if (safe_atoi(optarg, &ss_k) < 0 || ss_k < 2 || ss_k > 16) {
+                                fprintf(stderr, "`%s' is not valid for `k' (2 to 16)\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'S':
+                        farm_path = optarg;
+                        break;
+                case 'T':
+                        if (sscanf(optarg, "%dx%d", &tile_cols, &tile_rows) != 2 ||
+                            tile_cols <= 0 || tile_rows <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `colsxrows'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'W':
+                        worker_path = optarg;
+                        break;
+                case 'R':
+                        resume = 1;
+                        break;
+                case 'v':
+                        verbose = 1;
+                        break;
+                case 'w':
+                        if (sscanf(optarg, "%lf", &view_width) != 1 || !(view_width > 0)) {
+                                fprintf(stderr, "`%s' is not valid for `width'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                case 'z':
+                        if (safe_atoi(optarg, &nzooms) < 0 || nzooms <= 0) {
+                                fprintf(stderr, "`%s' is not valid for `n'\n", optarg);
+                                exit(1);
+                        }
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        argv += optind - 1;
+        argc -= optind - 1;
+
+        if (argc != 2) {
+            usage(argv[0]);
+        }
+        if (safe_atoi(argv[1], &nThreads) < 0 || nThreads <= 0) {
+                fprintf(stderr, "`%s' is not valid for `thread_count'\n", argv[1]);
+                exit(1);
+        }
+        if (!kernel)
+                kernel = fractal_find("mandel");
+        if (worker_path)
+                farm_worker(worker_path, nThreads);
+        if (bench) {
+                bench_kernels();
+                exit(0);
+        }
+        if (use_processes + (farm_workers >= 0) + (ckpt_path != NULL) +
+            (budget_ms >= 0) + (ss_k > 0) + (out_path != NULL) + (nzooms > 0) > 1) {
+                fprintf(stderr, "Only one of -p, -f, -C, -B, -s, -o and -z can be used\n");
+                exit(1);
+        }
+        if (nzooms > 0 && kernel != fractal_find("mandel")) {
+                fprintf(stderr, "-z only zooms into the Mandelbrot set\n");
+                exit(1);
+        }
+        if (resume && !ckpt_path) {
+                fprintf(stderr, "--resume needs a checkpoint file (-C)\n");
+                exit(1);
+        }
+        if (!farm_path) {
+                farm_path = safe_malloc(64);
+                snprintf(farm_path, 64, "/tmp/mandel-farm.%d", (int)getpid());
+        }
+
+        if (placement != TOPO_NONE) {
+                if (topo_load(&topo) < 0) {
+                        fprintf(stderr, "Failed to read the CPU topology\n");
+                        exit(1);
+                }
+                topo_describe(stderr, &topo, placement);
+        }
+
+        kernel_viewport(kernel);
+        if (have_center || view_width > 0) {
+                if (!have_center) {
+                        center_x.hi = (xmin + xmax) / 2;
+                        center_y.hi = (ymin + ymax) / 2;
+                }
+                if (view_width <= 0)
+                        view_width = xmax - xmin;
+                view_height = view_width * (ymax - ymin) / (xmax - xmin);
+                x0 = fractal_dd_add(center_x, -view_width / 2);
+                y0 = fractal_dd_add(center_y, view_height / 2);
+                xmin = x0.hi;
+                xmax = xmin + view_width;
+                ymax = y0.hi;
+                ymin = ymax - view_height;
+                mandel_ctx_init_dd(&view, x0, y0, view_width, view_height,
+                                   x_chars, y_chars, MANDEL_MAX_ITERATION);
+        } else
+                mandel_ctx_init(&view, xmin, xmax, ymin, ymax, x_chars, y_chars,
+                                MANDEL_MAX_ITERATION);
+        view.kernel = kernel;
+        view.cr = julia_cr;
+        view.ci = julia_ci;
+        if (view.dd && !mandel_ctx_dd(&view))
+                fprintf(stderr, "%s has no double-double kernel, points closer "
+                        "than %g blur together\n", kernel->name, MANDEL_DD_THRESHOLD);
+        else if (view.dd && verbose)
+                fprintf(stderr, "Rendering in double-double precision\n");
+
+        struct sigaction act;
+        sigset_t sigset;
+        act.sa_handler=sigint_handler;
+        sigemptyset(&sigset);
+        act.sa_mask=sigset;
+        act.sa_flags=SA_RESTART;
+        if(sigaction(SIGINT, &act, NULL) == -1) {
+                perror("sigaction");
+                exit(EXIT_FAILURE);
+        }
+
+        /* With a checkpoint, finish the rows in progress and save them */
+        if (ckpt_path) {
+                act.sa_handler = stop_handler;
+                act.sa_flags = 0;
+                if (sigaction(SIGINT, &act, NULL) == -1 ||
+                    sigaction(SIGTERM, &act, NULL) == -1) {
+                        perror("sigaction");
+                        exit(EXIT_FAILURE);
+                }
+        }
+
+        
+        /*
+         * draw the Mandelbrot Set, one line at a time.
+         * Output is sent to file descriptor '1', i.e., standard output.
+         */
+        start = now_sec();
+        if (ckpt_path)
+                render_checkpointed(nThreads);
+        else if (budget_ms >= 0)
+                render_budgeted(nThreads);
+        else if (ss_k > 0)
+                render_supersampled(nThreads);
+        else if (out_path)
+                render_streaming(nThreads);
+        else if (nzooms)
+                render_zooms(nThreads);
+        else if (farm_workers >= 0)
+                render_farm(nThreads);
+        else if (use_processes)
+                render_processes(nThreads);
+        else
+                render_threads(nThreads);
+
+        if (!out_path)
+                reset_xterm_color(1);
+        if (verbose && farm_workers >= 0)
+                fprintf(stderr, "%dx%d rendered in %.3fs by the render farm\n",
+                        x_chars, y_chars, now_sec() - start);
+        else if (verbose)
+                fprintf(stderr, "%dx%d rendered in %.3fs by %d %s\n", x_chars, y_chars,
+                        now_sec() - start, nThreads, use_processes ? "processes" : "threads");
         return 0;
 }
@@ -0,0 +1,166 @@
+/*
+ * perf-lib.c
+ *
+ * A small library for capturing per-thread hardware performance
+ * counters around a benchmark loop, falling back to getrusage()
+ * when perf_event_open() is not permitted.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "perf-lib.h"
+
+static const char *perf_event_names[PERF_NR_EVENTS] = {
+	"cycles", "instructions", "cache-misses", "LLC-misses", "ctx-switches"
+};
+
+/* glibc provides no wrapper for this one */
+static int sys_perf_event_open(struct perf_event_attr *attr,
+	pid_t pid, int cpu, int group_fd, unsigned long flags)
+{
+	return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+}
+
+static int open_event(int idx)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	switch (idx) {
+	case PERF_EV_CYCLES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case PERF_EV_INSTRUCTIONS:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case PERF_EV_CACHE_MISSES:
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	case PERF_EV_LLC_MISSES:
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_LL |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		break;
+	case PERF_EV_CTX_SWITCHES:
+		/* Scheduler events are only visible with the kernel included */
+		attr.type = PERF_TYPE_SOFTWARE;
+		attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+		attr.exclude_kernel = 0;
+		break;
+	default:
+		return -1;
+	}
+
+	/* pid = 0, cpu = -1: the calling thread, on whatever CPU it runs */
+	return sys_perf_event_open(&attr, 0, -1, -1, 0);
+}
+
+/*
+ * Open and enable all counters for the calling thread.
+ * Must be called from the thread to be measured.
+ */
+void perf_counters_start(struct perf_counters *pc)
+{
+	int i;
+
+	pc->nr_hw = 0;
+	for (i = 0; i < PERF_NR_EVENTS; i++) {
+		pc->val[i] = 0;
+		pc->fd[i] = open_event(i);
+		if (pc->fd[i] >= 0 && i != PERF_EV_CTX_SWITCHES)
+			pc->nr_hw++;
+	}
+
+	getrusage(RUSAGE_THREAD, &pc->ru_start);
+	clock_gettime(CLOCK_MONOTONIC, &pc->ts_start);
+
+	for (i = 0; i < PERF_NR_EVENTS; i++)
+		if (pc->fd[i] >= 0)
+			ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+	for (i = 0; i < PERF_NR_EVENTS; i++)
+		if (pc->fd[i] >= 0)
+			ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/*
+ * Disable, read and close all counters of the calling thread.
+ */
+void perf_counters_stop(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < PERF_NR_EVENTS; i++)
+		if (pc->fd[i] >= 0)
+			ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &pc->ts_end);
+	getrusage(RUSAGE_THREAD, &pc->ru_end);
+
+	for (i = 0; i < PERF_NR_EVENTS; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+		if (read(pc->fd[i], &pc->val[i], sizeof(pc->val[i])) !=
+		    sizeof(pc->val[i]))
+			pc->val[i] = -1;
+		close(pc->fd[i]);
+	}
+}
+
+static double tv_diff(struct timeval *a, struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+/*
+ * Print one line with everything we managed to measure.
+ * Events that could not be opened are shown as "n/a".
+ */
+void perf_counters_report(FILE *fp, const char *label, struct perf_counters *pc)
+{
+	int i;
+	double wall;
+
+	wall = (pc->ts_end.tv_sec - pc->ts_start.tv_sec) +
+		(pc->ts_end.tv_nsec - pc->ts_start.tv_nsec) / 1e9;
+
+	fprintf(fp, "%s: wall %.3fs", label, wall);
+	if (pc->nr_hw == 0) {
+		/* No permission (or no PMU): report what getrusage() knows */
+		fprintf(fp, " user %.3fs sys %.3fs vcsw %ld ivcsw %ld"
+			" [getrusage fallback]\n",
+			tv_diff(&pc->ru_start.ru_utime, &pc->ru_end.ru_utime),
+			tv_diff(&pc->ru_start.ru_stime, &pc->ru_end.ru_stime),
+			pc->ru_end.ru_nvcsw - pc->ru_start.ru_nvcsw,
+			pc->ru_end.ru_nivcsw - pc->ru_start.ru_nivcsw);
+		return;
+	}
+
+	for (i = 0; i < PERF_NR_EVENTS; i++) {
+		if (pc->fd[i] < 0 || pc->val[i] < 0)
+			fprintf(fp, " %s n/a", perf_event_names[i]);
+		else
+			fprintf(fp, " %s %lld", perf_event_names[i], pc->val[i]);
+	}
+	if (pc->fd[PERF_EV_CYCLES] >= 0 && pc->fd[PERF_EV_INSTRUCTIONS] >= 0 &&
+	    pc->val[PERF_EV_CYCLES] > 0)
+		fprintf(fp, " IPC %.2f", (double)pc->val[PERF_EV_INSTRUCTIONS] /
+			pc->val[PERF_EV_CYCLES]);
+	fprintf(fp, "\n");
+}
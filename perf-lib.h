@@ -0,0 +1,47 @@
+/*
+ * perf-lib.h
+ *
+ * A small library for capturing per-thread hardware performance
+ * counters around a benchmark loop, falling back to getrusage()
+ * when perf_event_open() is not permitted.
+ *
+ */
+
+#ifndef PERF_LIB_H__
+#define PERF_LIB_H__
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+/* The events we try to open, in report order */
+enum perf_event_idx {
+	PERF_EV_CYCLES,
+	PERF_EV_INSTRUCTIONS,
+	PERF_EV_CACHE_MISSES,
+	PERF_EV_LLC_MISSES,
+	PERF_EV_CTX_SWITCHES,
+	PERF_NR_EVENTS
+};
+
+/*
+ * One instance per measuring thread.
+ * fd[i] < 0 means event i could not be opened; if no hardware
+ * event could be opened, only the getrusage() figures are reported.
+ */
+struct perf_counters {
+	int fd[PERF_NR_EVENTS];
+	int nr_hw;
+	long long val[PERF_NR_EVENTS];
+
+	struct rusage ru_start, ru_end;
+	struct timespec ts_start, ts_end;
+};
+
+/* Function prototypes */
+void perf_counters_start(struct perf_counters *pc);
+void perf_counters_stop(struct perf_counters *pc);
+void perf_counters_report(FILE *fp, const char *label, struct perf_counters *pc);
+
+#endif /* PERF_LIB_H__ */
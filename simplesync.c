@@ -11,8 +11,26 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <cpuid.h>
+# include <immintrin.h>
+# define HAVE_RTM_INSNS 1
+#else
+# define HAVE_RTM_INSNS 0
+# define _XBEGIN_STARTED	(~0u)
+# define _XABORT_EXPLICIT	(1 << 0)
+# define _XABORT_RETRY		(1 << 1)
+# define _XABORT_CONFLICT	(1 << 2)
+# define _XABORT_CODE(x)	(((x) >> 24) & 0xff)
+#endif
+
+#include "perf-lib.h"
+#include "topo-lib.h"
 
 /* 
  * POSIX thread functions do not return error numbers in errno,
@@ -33,9 +51,98 @@ int atomic_lock = 0;
 /* Mutual Data in SYNC_MUTEX */
 pthread_mutex_t mutex_lock;
 
+/*
+ * Mutual Data in SYNC_FC (flat combining).
+ * Every thread owns one cache-line sized slot where it publishes
+ * its pending operation. Whoever grabs fc_lock becomes the combiner
+ * and applies all published operations in a single pass.
+ */
+#define FC_MAX_SLOTS 64
+
+struct fc_slot {
+	volatile int pending;
+	int delta;
+} __attribute__((aligned(64)));
+
+struct fc_slot fc_slots[FC_MAX_SLOTS];
+int fc_nslots = 0;
+volatile int fc_lock = 0;
+
+/* Number of combining passes, to see how much batching we get */
+long fc_passes = 0;
+
+/*
+ * Mutual Data in SYNC_ELISION.
+ * Updates run as RTM transactions that only read atomic_lock;
+ * on abort (or without RTM) we fall back to taking atomic_lock.
+ */
+#define ELISION_RETRIES 3
+
+int rtm_supported = 0;
+
+struct elision_stats {
+	long commits;
+	long aborts;
+	long conflicts;	/* Aborted due to a conflicting access */
+	long lock_busy;	/* Aborted because the fallback lock was held */
+	long fallbacks;	/* Gave up and took the lock */
+};
+
+
+/* Mutual Data in SYNC_RWLOCK */
+pthread_rwlock_t rw_lock;
+
+/*
+ * Mutual Data in SYNC_SPINRW.
+ * A spinning reader-writer lock. Arriving readers back off as soon
+ * as a writer is waiting, so writers cannot be starved by readers.
+ */
+struct spin_rwlock {
+	volatile int readers;
+	volatile int writer;
+	volatile int writers_waiting;
+} spin_rw;
+
+/*
+ * Mutual Data in SYNC_SEQLOCK.
+ * Writers serialize on atomic_lock and make seq odd while updating;
+ * readers retry until they see the same even seq before and after.
+ */
+volatile unsigned int seq = 0;
+
+/*
+ * Mutual Data in SYNC_EPOCH (RCU-like).
+ * Writers publish a fresh copy of the counter and retire the old one,
+ * tagged with the current epoch. Readers announce the epoch they
+ * entered in and never block; a retired copy is freed once no
+ * reader can still be looking at it.
+ */
+#define MAX_READERS 64
+#define EPOCH_RECLAIM_BATCH 64
+
+struct epoch_node {
+	int val;
+	unsigned long retired;	/* Epoch in which it was unpublished */
+	struct epoch_node *next;
+};
+
+struct epoch_slot {
+	volatile unsigned long active;	/* 0 if not inside a read */
+} __attribute__((aligned(64)));
 
-#if defined(SYNC_ATOMIC) ^ defined(SYNC_MUTEX) == 0
-# error You must #define exactly one of SYNC_ATOMIC or SYNC_MUTEX.
+struct epoch_node *volatile epoch_cur;
+volatile unsigned long global_epoch = 1;
+struct epoch_slot epoch_slots[MAX_READERS];
+int epoch_nslots = 0;
+struct epoch_node *epoch_retired;	/* Protected by atomic_lock */
+int epoch_nretired = 0;
+
+
+#if defined(SYNC_ATOMIC) + defined(SYNC_MUTEX) + defined(SYNC_FC) + \
+	defined(SYNC_ELISION) + defined(SYNC_RWLOCK) + defined(SYNC_SPINRW) + \
+	defined(SYNC_SEQLOCK) + defined(SYNC_EPOCH) != 1
+# error You must #define exactly one of SYNC_ATOMIC, SYNC_MUTEX, SYNC_FC, \
+	SYNC_ELISION, SYNC_RWLOCK, SYNC_SPINRW, SYNC_SEQLOCK or SYNC_EPOCH.
 #endif
 
 #if defined(SYNC_ATOMIC)
@@ -44,13 +151,404 @@ pthread_mutex_t mutex_lock;
 # define USE_ATOMIC_OPS 0
 #endif
 
+#if defined(SYNC_FC)
+# define USE_FC_OPS 1
+#else
+# define USE_FC_OPS 0
+#endif
+
+#if defined(SYNC_ELISION)
+# define USE_ELISION_OPS 1
+#else
+# define USE_ELISION_OPS 0
+#endif
+
+/* The reader-oriented schemes, see rw_write_apply() and read_val() */
+#if defined(SYNC_RWLOCK) || defined(SYNC_SPINRW) || \
+	defined(SYNC_SEQLOCK) || defined(SYNC_EPOCH)
+# define USE_RW_OPS 1
+#else
+# define USE_RW_OPS 0
+#endif
+
+/* Nonzero if -p was given: capture perf counters around the main loop */
+int use_perf = 0;
+
+/* Updates per writer thread (-n) */
+int nupdates = N;
+
+/* Reader threads (-r) and reads per update (-R), for read-mostly runs */
+int nreaders = 0;
+int read_ratio = 10;
+
+/* Thread placement policy (-a) */
+enum topo_policy placement = TOPO_NONE;
+struct topology topo;
+
+/*
+ * A (distinct) instance of this structure
+ * is passed to each thread
+ */
+struct thread_info_struct {
+	pthread_t tid;
+	volatile int *ip;
+	int cpu;	/* CPU we are pinned to, -1 if none */
+	int slot;	/* Our flat-combining slot, SYNC_FC only */
+	struct elision_stats es;	/* SYNC_ELISION only */
+	struct perf_counters pc;
+
+	/* Reader threads only */
+	int rdid;
+	long nreads;
+	double elapsed;
+};
+
+/*
+ * Add delta to *ip using flat combining:
+ * publish the operation in our slot, then either wait for a
+ * combiner to apply it, or become the combiner ourselves.
+ */
+void fc_apply(int slot, volatile int *ip, int delta)
+{
+	struct fc_slot *me = &fc_slots[slot];
+	int i, sum;
+
+	me->delta = delta;
+	__sync_synchronize();
+	me->pending = 1;
+
+	while (me->pending) {
+		if (fc_lock || !__sync_bool_compare_and_swap(&fc_lock, 0, 1))
+			continue;
+
+		/* We are the combiner, apply everything published so far */
+		sum = 0;
+		for (i = 0; i < fc_nslots; i++) {
+			if (fc_slots[i].pending) {
+				sum += fc_slots[i].delta;
+				__sync_synchronize();
+				fc_slots[i].pending = 0;
+			}
+		}
+		*ip += sum;
+		fc_passes++;
+
+		__sync_synchronize();
+		fc_lock = 0;
+	}
+}
+
+#if HAVE_RTM_INSNS
+/*
+ * Check CPUID leaf 7 for RTM, so the same binary
+ * runs on CPUs without TSX (or with TSX disabled).
+ */
+int detect_rtm(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx & bit_RTM) != 0;
+}
+
+/*
+ * Try to apply delta inside a hardware transaction.
+ * Returns _XBEGIN_STARTED on commit, the abort status otherwise.
+ */
+__attribute__((target("rtm")))
+unsigned int rtm_try_add(volatile int *ip, int delta)
+{
+	unsigned int status;
+
+	status = _xbegin();
+	if (status == _XBEGIN_STARTED) {
+		/* Subscribe to the lock, so a lock holder aborts us */
+		if (*(volatile int *)&atomic_lock)
+			_xabort(0xff);
+		*ip += delta;
+		_xend();
+	}
+	return status;
+}
+#else
+int detect_rtm(void)
+{
+	return 0;
+}
+
+unsigned int rtm_try_add(volatile int *ip, int delta)
+{
+	return 0;
+}
+#endif
+
+/*
+ * Add delta to *ip, eliding atomic_lock when the CPU lets us.
+ */
+void elided_apply(struct elision_stats *es, volatile int *ip, int delta)
+{
+	unsigned int status;
+	int tries;
+
+	for (tries = 0; rtm_supported && tries < ELISION_RETRIES; tries++) {
+		/* No point in starting while somebody holds the lock */
+		while (*(volatile int *)&atomic_lock)
+			;
+		status = rtm_try_add(ip, delta);
+		if (status == _XBEGIN_STARTED) {
+			es->commits++;
+			return;
+		}
+		es->aborts++;
+		if (status & _XABORT_CONFLICT)
+			es->conflicts++;
+		if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 0xff)
+			es->lock_busy++;
+		else if (!(status & _XABORT_RETRY))
+			break;
+	}
+
+	es->fallbacks++;
+	while (! __sync_bool_compare_and_swap(&atomic_lock,0,1))
+		;
+	/* Critical section */
+	*ip += delta;
+	/* Critical section */
+	__sync_synchronize();
+	atomic_lock = 0;
+}
+
+void report_elision(const char *label, struct elision_stats *es)
+{
+	long total = es->commits + es->fallbacks;
+
+	printf("%s: %ld commits, %ld aborts (%ld conflict, %ld lock busy), "
+		"%ld fallbacks, %.1f%% elided\n", label, es->commits, es->aborts,
+		es->conflicts, es->lock_busy, es->fallbacks,
+		total ? 100.0 * es->commits / total : 0.0);
+}
+
+void spin_read_lock(struct spin_rwlock *l)
+{
+	for (;;) {
+		while (l->writer || l->writers_waiting)
+			;
+		__sync_add_and_fetch(&l->readers, 1);
+		if (!l->writer)
+			return;
+		__sync_sub_and_fetch(&l->readers, 1);
+	}
+}
+
+void spin_read_unlock(struct spin_rwlock *l)
+{
+	__sync_sub_and_fetch(&l->readers, 1);
+}
+
+void spin_write_lock(struct spin_rwlock *l)
+{
+	__sync_add_and_fetch(&l->writers_waiting, 1);
+	while (! __sync_bool_compare_and_swap(&l->writer, 0, 1))
+		;
+	while (l->readers)
+		;
+	__sync_sub_and_fetch(&l->writers_waiting, 1);
+}
+
+void spin_write_unlock(struct spin_rwlock *l)
+{
+	__sync_synchronize();
+	l->writer = 0;
+}
+
+/*
+ * Free every retired copy that no reader can still see.
+ * Called by writers, with atomic_lock held.
+ */
+void epoch_reclaim(void)
+{
+	unsigned long min, a;
+	struct epoch_node **pp, *n;
+	int i;
+
+	min = global_epoch;
+	for (i = 0; i < epoch_nslots; i++) {
+		a = epoch_slots[i].active;
+		if (a && a < min)
+			min = a;
+	}
+
+	for (pp = &epoch_retired; (n = *pp) != NULL; ) {
+		if (n->retired < min) {
+			*pp = n->next;
+			free(n);
+			epoch_nretired--;
+		} else
+			pp = &n->next;
+	}
+}
+
+/*
+ * Writer side of the reader-oriented schemes.
+ * *ip is always kept up to date, so main() can check it as usual.
+ */
+void rw_write_apply(volatile int *ip, int delta)
+{
+#if defined(SYNC_RWLOCK)
+	int ret = pthread_rwlock_wrlock(&rw_lock);
+	if (ret) {
+		perror_pthread(ret, "pthread_rwlock_wrlock");
+		exit(1);
+	}
+	*ip += delta;
+	ret = pthread_rwlock_unlock(&rw_lock);
+	if (ret) {
+		perror_pthread(ret, "pthread_rwlock_unlock");
+		exit(1);
+	}
+#elif defined(SYNC_SPINRW)
+	spin_write_lock(&spin_rw);
+	*ip += delta;
+	spin_write_unlock(&spin_rw);
+#elif defined(SYNC_SEQLOCK)
+	while (! __sync_bool_compare_and_swap(&atomic_lock, 0, 1))
+		;
+	seq++;
+	__sync_synchronize();
+	*ip += delta;
+	__sync_synchronize();
+	seq++;
+	atomic_lock = 0;
+#elif defined(SYNC_EPOCH)
+	struct epoch_node *old, *new;
+
+	new = malloc(sizeof(*new));
+	if (!new) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	while (! __sync_bool_compare_and_swap(&atomic_lock, 0, 1))
+		;
+	old = epoch_cur;
+	new->val = old->val + delta;
+	__sync_synchronize();
+	epoch_cur = new;
+	*ip = new->val;
+
+	old->retired = global_epoch;
+	old->next = epoch_retired;
+	epoch_retired = old;
+	__sync_add_and_fetch(&global_epoch, 1);
+	if (++epoch_nretired >= EPOCH_RECLAIM_BATCH)
+		epoch_reclaim();
+
+	__sync_synchronize();
+	atomic_lock = 0;
+#endif
+}
+
+/*
+ * Read the shared counter under the scheme this binary was built for.
+ */
+int read_val(struct thread_info_struct *thr)
+{
+	volatile int *ip = thr->ip;
+	int v;
+
+	if (USE_ATOMIC_OPS || USE_ELISION_OPS) {
+		while (! __sync_bool_compare_and_swap(&atomic_lock, 0, 1))
+			;
+		v = *ip;
+		atomic_lock = 0;
+	} else if (USE_FC_OPS) {
+		/* Writers only touch val while holding fc_lock */
+		while (! __sync_bool_compare_and_swap(&fc_lock, 0, 1))
+			;
+		v = *ip;
+		fc_lock = 0;
+	} else if (USE_RW_OPS) {
+#if defined(SYNC_RWLOCK)
+		pthread_rwlock_rdlock(&rw_lock);
+		v = *ip;
+		pthread_rwlock_unlock(&rw_lock);
+#elif defined(SYNC_SPINRW)
+		spin_read_lock(&spin_rw);
+		v = *ip;
+		spin_read_unlock(&spin_rw);
+#elif defined(SYNC_SEQLOCK)
+		unsigned int s;
+
+		do {
+			while ((s = __atomic_load_n(&seq, __ATOMIC_ACQUIRE)) & 1)
+				;
+			v = *ip;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while (seq != s);
+#elif defined(SYNC_EPOCH)
+		struct epoch_slot *me = &epoch_slots[thr->rdid];
+
+		me->active = global_epoch;
+		__sync_synchronize();
+		v = epoch_cur->val;
+		__atomic_store_n(&me->active, 0, __ATOMIC_RELEASE);
+#endif
+	} else {
+		pthread_mutex_lock(&mutex_lock);
+		v = *ip;
+		pthread_mutex_unlock(&mutex_lock);
+	}
+
+	return v;
+}
+
+/*
+ * A reader thread: read the counter read_ratio times
+ * for every update a single writer does.
+ */
+void *read_fn(void *arg)
+{
+	struct thread_info_struct *thr = arg;
+	struct timespec ts_start, ts_end;
+	long i, n, sum = 0;
+	int v;
+
+	topo_bind_self(thr->cpu);
+	n = (long)nupdates * read_ratio;
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	for (i = 0; i < n; i++) {
+		v = read_val(thr);
+		if (v > nupdates || v < -nupdates) {
+			fprintf(stderr, "Reader %d: impossible value %d\n",
+				thr->rdid, v);
+			exit(1);
+		}
+		sum += v;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+
+	thr->nreads = n;
+	thr->elapsed = (ts_end.tv_sec - ts_start.tv_sec) +
+		(ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+
+	/* Keep the reads from being optimized away */
+	if (sum == 42)
+		fprintf(stderr, "The answer.\n");
+
+	return NULL;
+}
+
 void *increase_fn(void *arg)
 {
 	int i;
-	volatile int *ip = arg;
+	struct thread_info_struct *thr = arg;
+	volatile int *ip = thr->ip;
 	
-	fprintf(stderr, "About to increase variable %d times\n", N);
-	for (i = 0; i < N; i++) {
+	topo_bind_self(thr->cpu);
+	fprintf(stderr, "About to increase variable %d times\n", nupdates);
+	if (use_perf)
+		perf_counters_start(&thr->pc);
+	for (i = 0; i < nupdates; i++) {
 		if (USE_ATOMIC_OPS) {
 			while(! __sync_bool_compare_and_swap(&atomic_lock,0,1))
 			;
@@ -58,6 +556,12 @@ void *increase_fn(void *arg)
 			++(*ip);
 			/* Critical section */
 			atomic_lock = 0;
+		} else if (USE_FC_OPS) {
+			fc_apply(thr->slot, ip, 1);
+		} else if (USE_ELISION_OPS) {
+			elided_apply(&thr->es, ip, 1);
+		} else if (USE_RW_OPS) {
+			rw_write_apply(ip, 1);
 		} else {
 			int ret = pthread_mutex_lock(&mutex_lock);
 			if (ret){
@@ -74,6 +578,8 @@ void *increase_fn(void *arg)
 			}
 		}
 	}
+	if (use_perf)
+		perf_counters_stop(&thr->pc);
 	fprintf(stderr, "Done increasing variable.\n");
 
 	return NULL;
@@ -82,10 +588,14 @@ void *increase_fn(void *arg)
 void *decrease_fn(void *arg)
 {
 	int i;
-	volatile int *ip = arg;
+	struct thread_info_struct *thr = arg;
+	volatile int *ip = thr->ip;
 
-	fprintf(stderr, "About to decrease variable %d times\n", N);
-	for (i = 0; i < N; i++) {
+	topo_bind_self(thr->cpu);
+	fprintf(stderr, "About to decrease variable %d times\n", nupdates);
+	if (use_perf)
+		perf_counters_start(&thr->pc);
+	for (i = 0; i < nupdates; i++) {
 		if (USE_ATOMIC_OPS) {
 			while(! __sync_bool_compare_and_swap(&atomic_lock,0,1))
 			;
@@ -93,6 +603,12 @@ void *decrease_fn(void *arg)
 			--(*ip);
 			/* Critical section */
 			atomic_lock = 0;
+		} else if (USE_FC_OPS) {
+			fc_apply(thr->slot, ip, -1);
+		} else if (USE_ELISION_OPS) {
+			elided_apply(&thr->es, ip, -1);
+		} else if (USE_RW_OPS) {
+			rw_write_apply(ip, -1);
 		} else {
 			int ret = pthread_mutex_lock(&mutex_lock);
 			if (ret){
@@ -109,21 +625,112 @@ void *decrease_fn(void *arg)
 			}
 		}
 	}
+	if (use_perf)
+		perf_counters_stop(&thr->pc);
 	fprintf(stderr, "Done decreasing variable.\n");
 	
 	return NULL;
 }
 
+int safe_atoi(char *s, int *val)
+{
+	long l;
+	char *endp;
+
+	l = strtol(s, &endp, 10);
+	if (s != endp && *endp == '\0') {
+		*val = l;
+		return 0;
+	} else
+		return -1;
+}
+
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-p] [-n updates] [-r readers] [-R ratio] [-a policy]\n\n"
+		"Options:\n"
+		"    -p: Capture per-thread performance counters around the\n"
+		"        main loop (falls back to getrusage without permission).\n"
+		"    -n updates: Updates per writer thread (default %d).\n"
+		"    -r readers: Also run this many reader threads (default 0).\n"
+		"    -R ratio: Reads per update for each reader (default 10).\n"
+		"    -a policy: Pin threads to CPUs by topology: none, same-core,\n"
+		"        same-socket, cross-socket or spread (default none).\n",
+		argv0, N);
+	exit(1);
+}
 
 int main(int argc, char *argv[])
 {
-	int val, ret, ok;
-	pthread_t t1, t2;
+	int i, val, ret, ok, opt;
+	struct thread_info_struct t1, t2, *rd;
+	struct timespec ts_start, ts_end;
+	double elapsed, rd_elapsed;
+	long rd_total;
+
+	while ((opt = getopt(argc, argv, "pn:r:R:a:")) != -1) {
+		switch (opt) {
+		case 'p':
+			use_perf = 1;
+			break;
+		case 'n':
+			if (safe_atoi(optarg, &nupdates) < 0 || nupdates <= 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			if (safe_atoi(optarg, &nreaders) < 0 || nreaders < 0 ||
+			    nreaders > MAX_READERS)
+				usage(argv[0]);
+			break;
+		case 'R':
+			if (safe_atoi(optarg, &read_ratio) < 0 || read_ratio <= 0)
+				usage(argv[0]);
+			break;
+		case 'a':
+			if (topo_parse_policy(optarg, &placement) < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
 
 	/*
 	 * Initial value
 	 */
 	val = 0;
+	t1.ip = t2.ip = &val;
+	t1.slot = fc_nslots++;
+	t2.slot = fc_nslots++;
+	memset(&t1.es, 0, sizeof(t1.es));
+	memset(&t2.es, 0, sizeof(t2.es));
+	if (USE_ELISION_OPS)
+		rtm_supported = detect_rtm();
+
+	epoch_cur = calloc(1, sizeof(*epoch_cur));
+	rd = calloc(nreaders ? nreaders : 1, sizeof(*rd));
+	if (!epoch_cur || !rd) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nreaders; i++) {
+		rd[i].ip = &val;
+		rd[i].rdid = epoch_nslots++;
+	}
+
+	/*
+	 * Writers come first in the placement order, then readers
+	 */
+	if (placement != TOPO_NONE && topo_load(&topo) < 0) {
+		fprintf(stderr, "Failed to read the CPU topology\n");
+		exit(1);
+	}
+	t1.cpu = topo_place(&topo, placement, 0, 2 + nreaders);
+	t2.cpu = topo_place(&topo, placement, 1, 2 + nreaders);
+	for (i = 0; i < nreaders; i++)
+		rd[i].cpu = topo_place(&topo, placement, 2 + i, 2 + nreaders);
 
 	/*
 	 * Initialize mutex
@@ -134,30 +741,49 @@ int main(int argc, char *argv[])
             perror_pthread(ret, "pthread_mutex_init");
 			exit(1);
 	}
+	ret = pthread_rwlock_init(&rw_lock, NULL);
+	if (ret) {
+		perror_pthread(ret, "pthread_rwlock_init");
+		exit(1);
+	}
 
 	/*
 	 * Create threads
 	 */
-	ret = pthread_create(&t1, NULL, increase_fn, &val);
+	clock_gettime(CLOCK_MONOTONIC, &ts_start);
+	ret = pthread_create(&t1.tid, NULL, increase_fn, &t1);
 	if (ret) {
 		perror_pthread(ret, "pthread_create");
 		exit(1);
 	}
-	ret = pthread_create(&t2, NULL, decrease_fn, &val);
+	ret = pthread_create(&t2.tid, NULL, decrease_fn, &t2);
 	if (ret) {
 		perror_pthread(ret, "pthread_create");
 		exit(1);
 	}
+	for (i = 0; i < nreaders; i++) {
+		ret = pthread_create(&rd[i].tid, NULL, read_fn, &rd[i]);
+		if (ret) {
+			perror_pthread(ret, "pthread_create");
+			exit(1);
+		}
+	}
 
 	/*
 	 * Wait for threads to terminate
 	 */
-	ret = pthread_join(t1, NULL);
+	ret = pthread_join(t1.tid, NULL);
 	if (ret)
 		perror_pthread(ret, "pthread_join");
-	ret = pthread_join(t2, NULL);
+	ret = pthread_join(t2.tid, NULL);
 	if (ret)
 		perror_pthread(ret, "pthread_join");
+	clock_gettime(CLOCK_MONOTONIC, &ts_end);
+	for (i = 0; i < nreaders; i++) {
+		ret = pthread_join(rd[i].tid, NULL);
+		if (ret)
+			perror_pthread(ret, "pthread_join");
+	}
 
 	/*
 	 * Destroy mutex
@@ -175,5 +801,44 @@ int main(int argc, char *argv[])
 
 	printf("%sOK, val = %d.\n", ok ? "" : "NOT ", val);
 
+	elapsed = (ts_end.tv_sec - ts_start.tv_sec) +
+		(ts_end.tv_nsec - ts_start.tv_nsec) / 1e9;
+	printf("%d updates in %.3fs, %.2f Mops/s\n",
+		2 * nupdates, elapsed, 2 * nupdates / elapsed / 1e6);
+	if (placement != TOPO_NONE) {
+		topo_describe(stdout, &topo, placement);
+		printf("Placement: writers on CPUs %d, %d", t1.cpu, t2.cpu);
+		for (i = 0; i < nreaders; i++)
+			printf("%s%d", i ? ", " : "; readers on CPUs ", rd[i].cpu);
+		printf("\n");
+	}
+	if (nreaders) {
+		rd_total = 0;
+		rd_elapsed = 0;
+		for (i = 0; i < nreaders; i++) {
+			rd_total += rd[i].nreads;
+			if (rd[i].elapsed > rd_elapsed)
+				rd_elapsed = rd[i].elapsed;
+		}
+		printf("%d readers, %ld reads in %.3fs, %.2f Mreads/s "
+			"(%.2f per reader)\n", nreaders, rd_total, rd_elapsed,
+			rd_total / rd_elapsed / 1e6,
+			rd_total / rd_elapsed / 1e6 / nreaders);
+	}
+	if (USE_FC_OPS)
+		printf("%ld combining passes, %.2f ops per pass\n",
+			fc_passes, (double)2 * nupdates / fc_passes);
+	if (USE_ELISION_OPS) {
+		printf("RTM %s\n", rtm_supported ? "supported" :
+			"not supported, every update took the lock");
+		report_elision("increase", &t1.es);
+		report_elision("decrease", &t2.es);
+	}
+
+	if (use_perf) {
+		perf_counters_report(stdout, "increase", &t1.pc);
+		perf_counters_report(stdout, "decrease", &t2.pc);
+	}
+
 	return ok;
 }
@@ -14,6 +14,8 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#include "perf-lib.h"
+
 /* 
  * POSIX thread functions do not return error numbers in errno,
  * but in the actual return value of the function call instead.
@@ -40,12 +42,28 @@ pthread_mutex_t lock;
 # define USE_ATOMIC_OPS 0
 #endif
 
+/* Nonzero if -p was given: capture perf counters around the main loop */
+int use_perf = 0;
+
+/*
+ * A (distinct) instance of this structure
+ * is passed to each thread
+ */
+struct thread_info_struct {
+	pthread_t tid;
+	volatile int *ip;
+	struct perf_counters pc;
+};
+
 void *increase_fn(void *arg)
 {
 	int i;
-	volatile int *ip = arg;
+	struct thread_info_struct *thr = arg;
+	volatile int *ip = thr->ip;
 	
 	fprintf(stderr, "About to increase variable %d times\n", N);
+	if (use_perf)
+		perf_counters_start(&thr->pc);
 	for (i = 0; i < N; i++) {
 		if (USE_ATOMIC_OPS) 
 			/* Critical section */
@@ -68,6 +86,8 @@ void *increase_fn(void *arg)
 			}
 		}
 	}
+	if (use_perf)
+		perf_counters_stop(&thr->pc);
 	fprintf(stderr, "Done increasing variable.\n");
 
 	return NULL;
@@ -76,9 +96,12 @@ void *increase_fn(void *arg)
 void *decrease_fn(void *arg)
 {
 	int i;
-	volatile int *ip = arg;
+	struct thread_info_struct *thr = arg;
+	volatile int *ip = thr->ip;
 
 	fprintf(stderr, "About to decrease variable %d times\n", N);
+	if (use_perf)
+		perf_counters_start(&thr->pc);
 	for (i = 0; i < N; i++) {
 		if (USE_ATOMIC_OPS) {
 			/* Critical section */
@@ -100,21 +123,45 @@ void *decrease_fn(void *arg)
 			}
 		}
 	}
+	if (use_perf)
+		perf_counters_stop(&thr->pc);
 	fprintf(stderr, "Done decreasing variable.\n");
 	
 	return NULL;
 }
 
+void usage(char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-p]\n\n"
+		"Options:\n"
+		"    -p: Capture per-thread performance counters around the\n"
+		"        main loop (falls back to getrusage without permission).\n",
+		argv0);
+	exit(1);
+}
 
 int main(int argc, char *argv[])
 {
-	int val, ret, ok;
-	pthread_t t1, t2;
+	int val, ret, ok, opt;
+	struct thread_info_struct t1, t2;
+
+	while ((opt = getopt(argc, argv, "p")) != -1) {
+		switch (opt) {
+		case 'p':
+			use_perf = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc)
+		usage(argv[0]);
 
 	/*
 	 * Initial value
 	 */
 	val = 0;
+	t1.ip = t2.ip = &val;
 
 	/*
 	 * Initialize mutex
@@ -129,12 +176,12 @@ int main(int argc, char *argv[])
 	/*
 	 * Create threads
 	 */
-	ret = pthread_create(&t1, NULL, increase_fn, &val);
+	ret = pthread_create(&t1.tid, NULL, increase_fn, &t1);
 	if (ret) {
 		perror_pthread(ret, "pthread_create");
 		exit(1);
 	}
-	ret = pthread_create(&t2, NULL, decrease_fn, &val);
+	ret = pthread_create(&t2.tid, NULL, decrease_fn, &t2);
 	if (ret) {
 		perror_pthread(ret, "pthread_create");
 		exit(1);
@@ -143,10 +190,10 @@ int main(int argc, char *argv[])
 	/*
 	 * Wait for threads to terminate
 	 */
-	ret = pthread_join(t1, NULL);
+	ret = pthread_join(t1.tid, NULL);
 	if (ret)
 		perror_pthread(ret, "pthread_join");
-	ret = pthread_join(t2, NULL);
+	ret = pthread_join(t2.tid, NULL);
 	if (ret)
 		perror_pthread(ret, "pthread_join");
 
@@ -166,5 +213,10 @@ int main(int argc, char *argv[])
 
 	printf("%sOK, val = %d.\n", ok ? "" : "NOT ", val);
 
+	if (use_perf) {
+		perf_counters_report(stdout, "increase", &t1.pc);
+		perf_counters_report(stdout, "decrease", &t2.pc);
+	}
+
 	return ok;
 }
@@ -0,0 +1,225 @@
+/*
+ * topo-lib.c
+ *
+ * A small library that reads the CPU topology from /sys
+ * and places threads on CPUs according to a policy.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "topo-lib.h"
+
+static const char *policy_names[] = {
+	"none", "same-core", "same-socket", "cross-socket", "spread"
+};
+
+int topo_parse_policy(const char *s, enum topo_policy *policy)
+{
+	int i;
+
+	for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+		if (strcmp(s, policy_names[i]) == 0) {
+			*policy = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *topo_policy_name(enum topo_policy policy)
+{
+	return policy_names[policy];
+}
+
+/* Read a single integer from a /sys file, -1 if it is not there */
+static int read_sys_int(int cpu, const char *name)
+{
+	char path[128];
+	FILE *fp;
+	int val;
+
+	snprintf(path, sizeof(path),
+		"/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	if (fscanf(fp, "%d", &val) != 1)
+		val = -1;
+	fclose(fp);
+
+	return val;
+}
+
+/*
+ * Fill in topo with every CPU we are allowed to run on.
+ * CPUs whose topology cannot be read count as a core of their own.
+ */
+int topo_load(struct topology *topo)
+{
+	cpu_set_t set;
+	struct topo_cpu *c;
+	int cpu, i, j, n;
+
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_getaffinity");
+		return -1;
+	}
+
+	topo->ncpus = CPU_COUNT(&set);
+	topo->cpus = calloc(topo->ncpus, sizeof(*topo->cpus));
+	if (!topo->cpus)
+		return -1;
+
+	for (cpu = 0, n = 0; cpu < CPU_SETSIZE && n < topo->ncpus; cpu++) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		c = &topo->cpus[n++];
+		c->cpu = cpu;
+		c->socket = read_sys_int(cpu, "physical_package_id");
+		c->core = read_sys_int(cpu, "core_id");
+		if (c->socket < 0)
+			c->socket = 0;
+		if (c->core < 0)
+			c->core = cpu;
+	}
+
+	/* Number SMT siblings, and count distinct cores and sockets */
+	topo->ncores = topo->nsockets = 0;
+	for (i = 0; i < topo->ncpus; i++) {
+		c = &topo->cpus[i];
+		c->smt = 0;
+		for (j = 0; j < i; j++)
+			if (topo->cpus[j].socket == c->socket &&
+			    topo->cpus[j].core == c->core)
+				c->smt++;
+		if (c->smt == 0)
+			topo->ncores++;
+		for (j = 0; j < i; j++)
+			if (topo->cpus[j].socket == c->socket)
+				break;
+		if (j == i)
+			topo->nsockets++;
+	}
+
+	return 0;
+}
+
+/* Rank of a CPU's core among the cores of its socket */
+static int core_rank(struct topology *topo, struct topo_cpu *c)
+{
+	int i, rank = 0;
+
+	for (i = 0; i < topo->ncpus; i++)
+		if (topo->cpus[i].socket == c->socket &&
+		    topo->cpus[i].smt == 0 && topo->cpus[i].core < c->core)
+			rank++;
+	return rank;
+}
+
+/* Sort keys for every policy, most significant first */
+static void policy_key(struct topology *topo, enum topo_policy policy,
+	struct topo_cpu *c, int key[3])
+{
+	switch (policy) {
+	case TOPO_SAME_CORE:
+		key[0] = c->socket; key[1] = c->core; key[2] = c->smt;
+		break;
+	case TOPO_SAME_SOCKET:
+		key[0] = c->socket; key[1] = c->smt; key[2] = c->core;
+		break;
+	case TOPO_CROSS_SOCKET:
+		key[0] = c->smt; key[1] = core_rank(topo, c); key[2] = c->socket;
+		break;
+	default:
+		key[0] = c->smt; key[1] = c->socket; key[2] = c->core;
+		break;
+	}
+}
+
+static struct topology *sort_topo;
+static enum topo_policy sort_policy;
+
+static int cmp_cpus(const void *a, const void *b)
+{
+	int ka[3], kb[3], i;
+
+	policy_key(sort_topo, sort_policy, (struct topo_cpu *)a, ka);
+	policy_key(sort_topo, sort_policy, (struct topo_cpu *)b, kb);
+	for (i = 0; i < 3; i++)
+		if (ka[i] != kb[i])
+			return ka[i] - kb[i];
+	return ((struct topo_cpu *)a)->cpu - ((struct topo_cpu *)b)->cpu;
+}
+
+/*
+ * Return the CPU thread idx (out of nthreads) should run on,
+ * or -1 if the policy is TOPO_NONE.
+ * Not thread-safe, call it before spawning the threads.
+ */
+int topo_place(struct topology *topo, enum topo_policy policy,
+	int idx, int nthreads)
+{
+	struct topo_cpu *order;
+	int pos, cpu;
+
+	if (policy == TOPO_NONE || topo->ncpus == 0)
+		return -1;
+
+	order = malloc(topo->ncpus * sizeof(*order));
+	if (!order)
+		return -1;
+	memcpy(order, topo->cpus, topo->ncpus * sizeof(*order));
+	sort_topo = topo;
+	sort_policy = policy;
+	qsort(order, topo->ncpus, sizeof(*order), cmp_cpus);
+
+	/* The first ncores entries of the spread order are distinct cores */
+	if (policy == TOPO_SPREAD && nthreads <= topo->ncores)
+		pos = (long)idx * topo->ncores / nthreads;
+	else
+		pos = idx % topo->ncpus;
+	cpu = order[pos].cpu;
+	free(order);
+
+	return cpu;
+}
+
+/*
+ * Pin the calling thread to a single CPU. A negative cpu is a no-op.
+ */
+int topo_bind_self(int cpu)
+{
+	cpu_set_t set;
+	int ret;
+
+	if (cpu < 0)
+		return 0;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret)
+		fprintf(stderr, "pthread_setaffinity_np(cpu %d): %s\n",
+			cpu, strerror(ret));
+	return ret;
+}
+
+/*
+ * Summary printed with the results, so they can be read in context.
+ */
+void topo_describe(FILE *fp, struct topology *topo, enum topo_policy policy)
+{
+	fprintf(fp, "Placement: %s on %d CPUs, %d cores, %d sockets\n",
+		topo_policy_name(policy), topo->ncpus, topo->ncores,
+		topo->nsockets);
+	if (policy == TOPO_CROSS_SOCKET && topo->nsockets < 2)
+		fprintf(fp, "Placement: only one socket, cross-socket degrades to spread over cores\n");
+	if (policy == TOPO_SAME_CORE && topo->ncores == topo->ncpus)
+		fprintf(fp, "Placement: no SMT siblings, same-core degrades to one thread per core\n");
+}
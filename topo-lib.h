@@ -0,0 +1,45 @@
+/*
+ * topo-lib.h
+ *
+ * A small library that reads the CPU topology from /sys
+ * and places threads on CPUs according to a policy.
+ *
+ */
+
+#ifndef TOPO_LIB_H__
+#define TOPO_LIB_H__
+
+#include <stdio.h>
+
+enum topo_policy {
+	TOPO_NONE,		/* Leave placement to the scheduler */
+	TOPO_SAME_CORE,		/* Pack SMT siblings of one core first */
+	TOPO_SAME_SOCKET,	/* Distinct cores of one socket first */
+	TOPO_CROSS_SOCKET,	/* Alternate between sockets */
+	TOPO_SPREAD		/* Evenly over all sockets and cores */
+};
+
+struct topo_cpu {
+	int cpu;	/* Logical CPU number */
+	int core;	/* core_id, unique only within a socket */
+	int socket;	/* physical_package_id */
+	int smt;	/* Index among the SMT siblings of its core */
+};
+
+struct topology {
+	int ncpus;
+	int ncores;
+	int nsockets;
+	struct topo_cpu *cpus;
+};
+
+/* Function prototypes */
+int topo_parse_policy(const char *s, enum topo_policy *policy);
+const char *topo_policy_name(enum topo_policy policy);
+int topo_load(struct topology *topo);
+int topo_place(struct topology *topo, enum topo_policy policy,
+	int idx, int nthreads);
+int topo_bind_self(int cpu);
+void topo_describe(FILE *fp, struct topology *topo, enum topo_policy policy);
+
+#endif /* TOPO_LIB_H__ */
@@ -0,0 +1,131 @@
+/*
+ * trace-lib.c
+ *
+ * Binary kindergarten traces for record and replay: every thread
+ * appends fixed-size records to its own memory-mapped file, and
+ * kgtrace merges the files back into one timeline by streaming them.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "trace-lib.h"
+
+/* The file is mapped and extended this much at a time */
+#define TRACE_WINDOW	(4 * 1024 * 1024)
+
+/* Read buffer per file when streaming a trace back in */
+#define TRACE_READ_BUF	(256 * 1024)
+
+/*
+ * Create prefix.<thrid> and map its first window.
+ * Since the mapping is shared, whatever was written survives even
+ * if the process dies without calling trace_close().
+ */
+int trace_open(struct trace_buf *tb, const char *prefix,
+	const struct trace_header *hdr)
+{
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s.%d", prefix, hdr->thrid);
+	tb->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (tb->fd < 0) {
+		perror(path);
+		return -1;
+	}
+	tb->map = NULL;
+	tb->pos = tb->len = 0;
+	tb->map_off = 0;
+	if (trace_grow(tb) < 0)
+		return -1;
+
+	memcpy(tb->map, hdr, sizeof(*hdr));
+	tb->pos = sizeof(*hdr);
+	return 0;
+}
+
+/* Move on to the next window, extending the file */
+int trace_grow(struct trace_buf *tb)
+{
+	if (tb->fd < 0)
+		return -1;
+	if (tb->map) {
+		munmap(tb->map, tb->len);
+		tb->map_off += tb->len;
+	}
+	tb->map = NULL;
+	tb->pos = tb->len = 0;
+
+	if (ftruncate(tb->fd, tb->map_off + TRACE_WINDOW) < 0) {
+		perror("trace: ftruncate");
+		goto fail;
+	}
+	tb->map = mmap(NULL, TRACE_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED,
+		tb->fd, tb->map_off);
+	if (tb->map == MAP_FAILED) {
+		perror("trace: mmap");
+		tb->map = NULL;
+		goto fail;
+	}
+	tb->len = TRACE_WINDOW;
+	return 0;
+
+fail:
+	/* Stop tracing this thread rather than fail on every event */
+	close(tb->fd);
+	tb->fd = -1;
+	return -1;
+}
+
+/* Unmap, and cut the unused tail of the last window off the file */
+void trace_close(struct trace_buf *tb)
+{
+	if (tb->fd < 0)
+		return;
+	munmap(tb->map, tb->len);
+	if (ftruncate(tb->fd, tb->map_off + tb->pos) < 0)
+		perror("trace: ftruncate");
+	close(tb->fd);
+	tb->fd = -1;
+}
+
+int trace_reader_open(struct trace_reader *tr, const char *path)
+{
+	tr->fp = fopen(path, "r");
+	if (!tr->fp)
+		return -1;
+	tr->buf = malloc(TRACE_READ_BUF);
+	if (tr->buf)
+		setvbuf(tr->fp, tr->buf, _IOFBF, TRACE_READ_BUF);
+
+	if (fread(&tr->hdr, sizeof(tr->hdr), 1, tr->fp) != 1 ||
+	    tr->hdr.magic != TRACE_MAGIC) {
+		fprintf(stderr, "%s: not a kgarten trace\n", path);
+		trace_reader_close(tr);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns 1 if a record was read, 0 at the end of the trace */
+int trace_read(struct trace_reader *tr, struct trace_rec *rec)
+{
+	if (fread(rec, sizeof(*rec), 1, tr->fp) != 1)
+		return 0;
+	return rec->ts != 0;
+}
+
+void trace_reader_close(struct trace_reader *tr)
+{
+	fclose(tr->fp);
+	free(tr->buf);
+	tr->fp = NULL;
+	tr->buf = NULL;
+}
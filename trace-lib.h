@@ -0,0 +1,100 @@
+/*
+ * trace-lib.h
+ *
+ * Binary kindergarten traces for record and replay: every thread
+ * appends fixed-size records to its own memory-mapped file, and
+ * kgtrace merges the files back into one timeline by streaming them.
+ *
+ */
+
+#ifndef TRACE_LIB_H__
+#define TRACE_LIB_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define TRACE_MAGIC	0x6b67747263000001ULL	/* "kgtrc", version 1 */
+
+/*
+ * Every transition is traced twice: when it is requested and when
+ * it is done. For enters and exits that may block, the gap is the
+ * wait; for the others it bounds when the counts actually changed.
+ */
+enum trace_event {
+	TR_CHILD_ENTER, TR_CHILD_ENTERED,
+	TR_CHILD_EXIT, TR_CHILD_EXITED,
+	TR_TEACHER_ENTER, TR_TEACHER_ENTERED,
+	TR_TEACHER_EXIT, TR_TEACHER_EXITED,
+	TR_GAVE_UP,		/* Waited too long (-T) or found the gate busy (-Y) */
+	TR_NR_EVENTS
+};
+
+/*
+ * At the start of every per-thread file. Its size is a multiple of
+ * the record size, so records never straddle two mapped windows.
+ */
+struct trace_header {
+	uint64_t magic;
+	int32_t thrid;
+	int32_t thrcnt;
+	int32_t ratio;
+	int32_t nrooms;
+	int32_t group;		/* Children per child thread, 0 in old traces */
+	int32_t reserved[1];
+};
+
+/* A zero timestamp marks the end of a file that was never closed */
+struct trace_rec {
+	uint64_t ts;		/* CLOCK_MONOTONIC, in nanoseconds */
+	uint32_t thrid;
+	uint16_t room;
+	uint16_t event;
+};
+
+/* Writer side, one per thread */
+struct trace_buf {
+	int fd;
+	char *map;		/* Current window of the file */
+	size_t pos, len;	/* Within the window */
+	off_t map_off;		/* File offset of the window */
+};
+
+/* Reader side, one per file */
+struct trace_reader {
+	FILE *fp;
+	struct trace_header hdr;
+	char *buf;		/* stdio buffer, so memory stays bounded */
+};
+
+/* Function prototypes */
+int trace_open(struct trace_buf *tb, const char *prefix,
+	const struct trace_header *hdr);
+void trace_close(struct trace_buf *tb);
+int trace_grow(struct trace_buf *tb);
+
+/*
+ * Append one record. The common case is a store into the mapped
+ * window; only crossing into the next window costs a system call.
+ */
+static inline void trace_event(struct trace_buf *tb, uint64_t ts, int thrid,
+	int room, int event)
+{
+	struct trace_rec *rec;
+
+	if (tb->pos + sizeof(*rec) > tb->len && trace_grow(tb) < 0)
+		return;
+	rec = (struct trace_rec *)(tb->map + tb->pos);
+	rec->ts = ts;
+	rec->thrid = thrid;
+	rec->room = room;
+	rec->event = event;
+	tb->pos += sizeof(*rec);
+}
+
+int trace_reader_open(struct trace_reader *tr, const char *path);
+int trace_read(struct trace_reader *tr, struct trace_rec *rec);
+void trace_reader_close(struct trace_reader *tr);
+
+#endif /* TRACE_LIB_H__ */